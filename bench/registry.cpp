@@ -0,0 +1,190 @@
+// Memory per app and lookup latency of the registry, against the maps it
+// replaced: std::map<std::string, app_t> of the configuration plus
+// std::map<std::string, child_t> of the running instances.
+//
+//     make bench && ./bench/registry [APPS]
+
+// headers
+#include "src/registry.hpp" // registry_t
+#include "src/common.hpp"   // app_t, argv_t
+
+// posix
+#include <sys/resource.h> // rusage
+#include <malloc.h>     // malloc_usable_size
+#include <sys/types.h>  // pid_t
+
+// c
+#include <cstdio>       // printf
+#include <cstdlib>      // malloc, free, atoi
+
+// cpp
+#include <algorithm>    // replace
+#include <chrono>       // steady_clock
+#include <filesystem>   // fs::path
+#include <map>          // map
+#include <new>          // bad_alloc
+#include <optional>     // optional
+#include <random>       // mt19937
+#include <string>       // string
+#include <vector>       // vector
+
+
+// live heap bytes, as the allocator sees them
+static size_t heap = 0;
+
+// the replaced operators pair malloc with free themselves
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size)
+{
+    void* p = std::malloc(size);
+    if (!p)
+        throw std::bad_alloc{};
+    heap += malloc_usable_size(p);
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p)
+        heap -= malloc_usable_size(p);
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+
+// The former layout, each argv kept its own array of pointers.
+struct old_argv_t
+{
+    std::string data;
+    std::vector<char*> ptrs;
+
+    old_argv_t(std::string str) : data(std::move(str))
+    {
+        std::replace(data.begin(), data.end(), ' ', '\0');
+        ptrs.push_back(&data[0]);
+        for (size_t i = 0; i < data.size(); i++)
+            if (data[i] == '\0')
+                ptrs.push_back(&data[i + 1]);
+        ptrs.push_back(nullptr);
+    }
+};
+
+struct old_app_t
+{
+    std::filesystem::path dir;
+    old_argv_t start;
+    old_argv_t update;
+    std::optional<exit_t> exit{};
+    std::int64_t started = 0;
+    std::uint32_t starts = 0;
+    std::uint64_t gen = 0;
+    std::optional<struct rusage> usage{};
+};
+
+// what a running instance took in the map, but the proc_t itself
+struct old_child_t
+{
+    pid_t pid;
+    int pidfd;
+    std::uint64_t watch;
+    std::vector<int> on_exit;
+};
+
+
+static std::string name_of(size_t i)
+{
+    return "tenant-" + std::to_string(i / 100) + "-app-" + std::to_string(i);
+}
+
+
+template<typename Func>
+static double ns_per_op(size_t ops, Func&& func)
+{
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count()
+         / double(ops);
+}
+
+
+int main(int argc, char** argv)
+{
+    size_t count = argc > 1 ? std::atoi(argv[1]) : 100000;
+    constexpr size_t Lookups = 2000000;
+
+    auto names = std::vector<std::string>{};
+    for (size_t i = 0; i < count; ++i)
+        names.push_back(name_of(i));
+
+    // the keys looked up, as they arrive in requests
+    auto rng = std::mt19937{ 42 };
+    auto keys = std::vector<std::string>{};
+    for (size_t i = 0; i < 4096; ++i)
+        keys.push_back(names[rng() % count]);
+
+    const auto dir = std::string{ "/srv/apps/tenant/app" };
+    const auto start = std::string{ "/usr/bin/app --config app.conf" };
+    const auto update = std::string{ "git pull" };
+
+    // every fourth app is running
+    size_t before = heap;
+    auto apps = std::map<std::string, old_app_t>{};
+    auto procs = std::map<std::string, old_child_t>{};
+    for (size_t i = 0; i < count; ++i)
+    {
+        apps.emplace(names[i], old_app_t{ dir, old_argv_t{ start },
+                                          old_argv_t{ update } });
+        if (i % 4 == 0)
+            procs.emplace(names[i], old_child_t{ pid_t(i), 3, i, {} });
+    }
+    size_t old_bytes = heap - before;
+
+    before = heap;
+    auto reg = registry_t{};
+    reg.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        reg.add(names[i], app_t{ dir, argv_t{ start }, argv_t{ update } });
+    auto children = std::vector<std::optional<old_child_t>>(count);
+    for (size_t i = 0; i < count; i += 4)
+    {
+        reg.pid[i] = pid_t(i);
+        children[i] = old_child_t{ pid_t(i), 3, i, {} };
+    }
+    size_t new_bytes = heap - before;
+
+    // a command looks up the app, and whether it runs
+    size_t found = 0;
+    double old_ns = ns_per_op(Lookups, [&]
+    {
+        for (size_t i = 0; i < Lookups; ++i)
+        {
+            const auto& key = keys[i % keys.size()];
+            found += apps.find(key) != apps.end();
+            found += procs.find(key) != procs.end();
+        }
+    });
+
+    double new_ns = ns_per_op(Lookups, [&]
+    {
+        for (size_t i = 0; i < Lookups; ++i)
+        {
+            auto id = reg.find(keys[i % keys.size()]);
+            found += id != registry_t::none;
+            found += reg.running(id);
+        }
+    });
+
+    std::printf("apps: %zu (checksum %zu)\n\n", count, found);
+    std::printf("%-10s %14s %16s\n", "", "bytes/app", "ns/lookup");
+    std::printf("%-10s %14.1f %16.1f\n", "maps",
+                double(old_bytes) / count, old_ns);
+    std::printf("%-10s %14.1f %16.1f\n", "registry",
+                double(new_bytes) / count, new_ns);
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Latency of spawning an app by each engine of proc.hpp, and by the spawn
+// helper of zygote.hpp, as the memory of the daemon grows. The time is that
+// of the daemon, until the engine returns, the child is reaped outside of it.
+//
+//     make bench && ./bench/spawn [SPAWNS] [MB...]
+
+// headers
+#include "src/proc.hpp" // spawn_*
+#include "src/zygote.hpp" // zygote_t
+#include "src/fd.hpp"   // fd_t
+
+// posix
+#include <sys/mman.h>   // mmap
+#include <sys/wait.h>   // waitpid
+#include <unistd.h>     // close
+#include <fcntl.h>      // open
+
+// c
+#include <cstdio>       // printf
+#include <cstdlib>      // atoi
+#include <cstring>      // memset
+
+// cpp
+#include <chrono>       // steady_clock
+#include <vector>       // vector
+
+
+using engine_ptr = pid_t (*) (spawn_t&, int&);
+
+
+static double us_per_spawn(engine_ptr engine, int spawns)
+{
+    char true_[] = "true";
+    char* argv[] = { true_, nullptr };
+
+    // the output goes where an app's would, into a descriptor of srvd
+    fd_t null = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    auto s = spawn_t{ argv, "/" };
+    s.dups.emplace_back(1, null.fd);
+
+    double total = 0;
+    for (int i = 0; i < spawns; ++i)
+    {
+        int pidfd = -1;
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid = engine(s, pidfd);
+        auto end = std::chrono::steady_clock::now();
+        total += std::chrono::duration<double, std::micro>(end - start)
+                     .count();
+
+        ::waitpid(pid, nullptr, 0);
+        ::close(pidfd);
+    }
+    return total / spawns;
+}
+
+
+int main(int argc, char** argv)
+{
+    int spawns = argc > 1 ? std::atoi(argv[1]) : 200;
+
+    auto sizes = std::vector<size_t>{};
+    for (int i = 2; i < argc; ++i)
+        sizes.push_back(std::atoi(argv[i]));
+    if (sizes.empty())
+        sizes = { 0, 256, 1024, 2048 };
+
+    // forked while small, as by srvd
+    auto zygote = zygote_t::start();
+    ZYGOTE = &zygote;
+
+    std::printf("spawns: %d, µs each\n\n", spawns);
+    std::printf("%10s %12s %12s %12s %12s\n", "RSS MB", "fork",
+                "posix_spawn", "clone", "helper");
+
+    // the daemon's memory, touched so that it has page tables to copy
+    size_t mapped = 0;
+    for (size_t mb : sizes)
+    {
+        if (mb > mapped)
+        {
+            size_t len = (mb - mapped) << 20;
+            void* mem = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED)
+                return std::perror("mmap"), 1;
+            std::memset(mem, 1, len);
+            mapped = mb;
+        }
+
+        std::printf("%10zu %12.1f %12.1f %12.1f %12.1f\n", mapped,
+                    us_per_spawn(spawn_fork, spawns),
+                    us_per_spawn(spawn_posix, spawns),
+                    us_per_spawn(spawn_clone, spawns),
+                    us_per_spawn(spawn_zygote, spawns));
+    }
+    return 0;
+}
@@ -0,0 +1,217 @@
+#include "client.hpp"
+
+// posix
+#include <unistd.h>     // getuid
+#include <sys/types.h>  // getuid, getpwuid
+#include <sys/socket.h> // socket, connect, send
+#include <sys/un.h>     // sockaddr_un
+#include <pwd.h>        // getpwuid
+#include <poll.h>       // poll
+#include <fcntl.h>      // fcntl
+
+// c
+#include <cerrno>       // errno
+#include <cstring>      // strncpy, strerror
+
+// cpp
+#include <algorithm>    // max
+#include <string>       // string
+#include <stdexcept>    // runtime_error
+#include <utility>      // move
+
+
+namespace fs = std::filesystem;
+
+
+static std::runtime_error sys_error(const char* what, int err)
+{
+    return std::runtime_error(std::string{ what } + ": "
+                              + std::strerror(err));
+}
+
+
+fs::path client_t::default_socket()
+{
+    struct passwd* pw = ::getpwuid(::getuid());
+    if (!pw)
+        throw std::runtime_error("cannot obtain HOME");
+
+    return fs::path{ pw->pw_dir } / ".srvctl" / ".socket";
+}
+
+
+message client_t::request(const std::string& cmd,
+                          const std::vector<std::string>& args)
+{
+    auto msg = message{ cmd.c_str() };
+    for (const auto& arg : args)
+        msg.add_line(arg.c_str());
+    return msg;
+}
+
+
+client_t::client_t(const fs::path& path)
+{
+    sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!sock)
+        throw sys_error("socket", errno);
+
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path));
+
+    // blocking, a local connect waits only while the daemon's backlog
+    // is full
+    if (::connect(sock.fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+        throw sys_error("connect", errno);
+
+    if (::fcntl(sock.fd, F_SETFL, O_NONBLOCK) == -1)
+        throw sys_error("fcntl", errno);
+}
+
+
+message client_t::call(message req, callback_t on_partial)
+{
+    auto resp = message{};
+    bool done = false;
+
+    submit(std::move(req), [&](const message& msg)
+    {
+        if (msg.more)
+        {
+            if (on_partial)
+                on_partial(msg);
+            return;
+        }
+
+        resp = msg;
+        done = true;
+    });
+
+    while (!done)
+        wait();
+
+    return resp;
+}
+
+
+std::uint32_t client_t::submit(message req, callback_t on_reply)
+{
+    // skip ids still in flight, in case the counter wrapped around
+    while (pending.count(next_id) != 0)
+        ++next_id;
+
+    req.id = next_id++;
+    req.serialize(tx);
+    pending.emplace(req.id, std::move(on_reply));
+    return req.id;
+}
+
+
+short client_t::events() const
+{
+    short ev = 0;
+    if (!pending.empty())
+        ev |= POLLIN;
+    if (sent < tx.size())
+        ev |= POLLOUT;
+    return ev;
+}
+
+
+void client_t::process(short revents)
+{
+    if (revents & POLLOUT)
+    {
+        while (sent < tx.size())
+        {
+            auto w = ::send(sock.fd, tx.data() + sent, tx.size() - sent,
+                            MSG_NOSIGNAL);
+            if (w == -1 && errno == EINTR)
+                continue;
+            if (w == -1 && errno == EAGAIN)
+                break;
+            if (w == -1)
+                throw sys_error("send", errno);
+            sent += w;
+        }
+
+        if (sent == tx.size())
+        {
+            tx.clear();
+            sent = 0;
+        }
+    }
+
+    if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+        return;
+
+    bool closed = false;
+
+    char buf[16384];
+    while (!closed)
+    {
+        auto r = sock.read(buf, sizeof(buf));
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && errno == EAGAIN)
+            break;
+        if (r == -1)
+            throw sys_error("recv", errno);
+
+        closed = (r == 0);
+        rx.append(buf, std::max<ssize_t>(r, 0));
+    }
+
+    size_t pos = 0;
+    auto msg = message{};
+    while (size_t used = msg.parse(rx.data() + pos, rx.size() - pos))
+    {
+        pos += used;
+
+        auto it = pending.find(msg.id);
+        if (it == pending.end())
+            continue;
+
+        if (msg.more)
+        {
+            if (it->second)
+                it->second(msg);
+            continue;
+        }
+
+        // the callback may submit new requests
+        auto func = std::move(it->second);
+        pending.erase(it);
+        if (func)
+            func(msg);
+    }
+    rx.erase(0, pos);
+
+    if (closed && !pending.empty())
+        throw sys_error("recv", ECONNRESET);
+}
+
+
+bool client_t::wait(int timeout)
+{
+    struct pollfd pfd = { sock.fd, events(), 0 };
+
+    int r = ::poll(&pfd, 1, timeout);
+    if (r == -1 && errno == EINTR)
+        return true;
+    if (r == -1)
+        throw sys_error("poll", errno);
+    if (r == 0)
+        return false;
+
+    process(pfd.revents);
+    return true;
+}
+
+
+void client_t::run()
+{
+    while (!pending.empty())
+        wait();
+}
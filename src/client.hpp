@@ -0,0 +1,76 @@
+#pragma once
+
+// headers
+#include "message.hpp"  // message
+#include "fd.hpp"       // fd_t
+
+// cpp
+#include <cstdint>      // uint32_t
+#include <filesystem>   // fs::path
+#include <functional>   // function
+#include <map>          // map
+#include <string>       // string
+#include <vector>       // vector
+
+
+/*
+ * Client side of the srvd control protocol (libsrvctl).
+ *
+ * Synchronous use:
+ *
+ *     auto cl = client_t{ client_t::default_socket() };
+ *     message resp = cl.call(client_t::request("start", { "app" }));
+ *
+ * Asynchronous use: submit() any number of requests, they are pipelined
+ * over the one connection and each callback is invoked with the partial
+ * replies (message::more set) and finally with the final reply. Drive the
+ * I/O with run()/wait(), or from an external event loop by polling fd()
+ * for events() and calling process() when it is ready.
+ *
+ * Errors of the connection itself are reported by std::runtime_error.
+ */
+struct client_t
+{
+    using callback_t = std::function<void(const message&)>;
+
+    fd_t sock{ -1 };
+    std::string rx{};
+    std::string tx{};
+    size_t sent = 0;
+    std::uint32_t next_id = 0;
+    std::map<std::uint32_t, callback_t> pending{};
+
+    // ~/.srvctl/.socket of the current user
+    static std::filesystem::path default_socket();
+
+    static message request(const std::string& cmd,
+                           const std::vector<std::string>& args = {});
+
+    explicit client_t(const std::filesystem::path& path);
+
+    // Sends a request and waits for its final reply, which is returned.
+    // Replies to other requests in flight are dispatched meanwhile.
+    message call(message req, callback_t on_partial = {});
+
+    // Queues a request, returns its id. Nothing is written until the
+    // connection is driven by process(), wait(), or run().
+    std::uint32_t submit(message req, callback_t on_reply);
+
+    size_t in_flight() const { return pending.size(); }
+
+    int fd() const { return sock.fd; }
+
+    // poll(2) events to wait for
+    short events() const;
+
+    // Performs the non-blocking I/O indicated by poll's ‹revents›, and
+    // invokes the callbacks of replies that arrived.
+    void process(short revents);
+
+    // Waits up to ‹timeout› ms for the connection, and processes it.
+    // Returns false on timeout.
+    bool wait(int timeout = -1);
+
+    // Drives the connection until no request is in flight.
+    void run();
+};
@@ -4,47 +4,137 @@
 #include "fd.hpp"       // fd_t
 #include "signames.hpp" // str_sig
 
+// deps
+#include "deps/json.hpp"
+
+// posix
+#include <unistd.h>     // pipe2
+#include <sys/timerfd.h> // timerfd_*
+#include <fcntl.h>      // fcntl, O_*
+#include <fnmatch.h>    // fnmatch
+
+// c
+#include <cstring>      // strerror
+#include <cerrno>       // errno
+#include <cstdlib>      // strtod, strtol, strtoull
+#include <cstdint>      // SIZE_MAX
+#include <cmath>        // isfinite
+#include <cctype>       // isdigit
+
 // cpp
+#include <algorithm>    // min, stable_sort
+#include <memory>       // make_shared, shared_ptr
 #include <string>       // string
+#include <string_view>  // string_view
+#include <utility>      // exchange
 #include <variant>      // get_if
 #include <array>        // array
+#include <exception>    // exception
 
 
 namespace fs = std::filesystem;
 
 
-message cmd_start (const message&, server_t&);
-message cmd_stop  (const message&, server_t&);
-message cmd_update(const message&, server_t&);
-message cmd_list  (const message&, server_t&);
-message cmd_signal(const message&, server_t&);
+using json = nlohmann::json;
+
+
+auto cmd_start (const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_stop  (const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_update(const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_list  (const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_signal(const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_watch (const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_wait  (const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_resolve(const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_reload(const message&, server_t&, const reply_t&) -> std::optional<message>;
+auto cmd_stats (const message&, server_t&, const reply_t&) -> std::optional<message>;
 
 
 extern const std::map<std::string, command> COMMANDS =
 {
     { "start",  command{ cmd_start,
-                         { "APP" },
+                         { "APP...|--all|-l SELECTOR" },
                          { "Start app by given name.",
                            "This app name must be present in ",
-                           "the respective configuration file." } } },
+                           "the respective configuration file.",
+                           "Every command taking an APP accepts its handle too.",
+                           "Given more apps, or --all of those not running,",
+                           "they are started at once, and the result for each",
+                           "is listed as ‹APP: RESULT›.",
+                           "-l selects apps by their labels, a SELECTOR is a list",
+                           "of terms ‹KEY=VALUE›, ‹KEY!=VALUE›, ‹KEY› or ‹!KEY›",
+                           "separated by ‹,›, each of which must hold; the KEY",
+                           "‹name› matches the names of apps against a glob.",
+                           "The apps selected are treated as by --all." } } },
     { "stop",   command{ cmd_stop,
-                         { "APP" },
+                         { "APP...|--all|-l SELECTOR" },
                          { "Stop a running instance of app of the given name.",
                            "It must be running.",
-                           "The app is stopped by sending SIGKILL." } } },
+                           "The app is stopped by sending SIGKILL.",
+                           "Given more apps, or --all of those running, all are",
+                           "signalled first, and answered once all have exited." } } },
     { "update", command{ cmd_update,
                          { "APP" },
                          { "Update a given app. If the app is currently running,",
-                           "it is first stopped as if by command ‹stop›." } } },
+                           "it is first stopped as if by command ‹stop›.",
+                           "Output of the update is shown as it is produced,",
+                           "interrupting the client cancels the update." } } },
     { "list",   command{ cmd_list,
-                         {},
+                         { "[--since GEN]", "[--json]", "[--state STATE]",
+                           "[--name GLOB]", "[-l SELECTOR]", "[--sort KEY]",
+                           "[--limit N]", "[--after APP]" },
                          { "List each apps loaded from the configuration file",
                            "If an instance is running, PID is listed.",
                            "If the app had been stopped, information about",
-                           "signal/return is listed." } } },
+                           "signal/return is listed.",
+                           "It is read from the status page published by srvd,",
+                           "which stays readable as stale data if srvd is down.",
+                           "With --since, only apps changed after generation GEN",
+                           "are listed, preceded by the current generation,",
+                           "‹BOOT:N›; all are, if GEN is of another run of srvd.",
+                           "--json prints a JSON object per app with all the fields,",
+                           "including resource usage of the last run, and a last",
+                           "one with the generation and the ‹next› cursor.",
+                           "--state (running, stopped), --name and -l select apps,",
+                           "--sort orders them by name, pid, started or restarts.",
+                           "--limit lists at most N apps, if more remain, the last",
+                           "one is given as ‹next›, to continue with --after.",
+                           "The JSON objects include the ‹handle› of each app." } } },
+    { "resolve", command{ cmd_resolve,
+                         { "APP..." },
+                         { "Print the handle of each app, ‹@EPOCH:ID›, one per line.",
+                           "A handle is looked up without hashing the name,",
+                           "until a reload of the configuration invalidates it." } } },
+    { "reload", command{ cmd_reload,
+                         {},
+                         { "Load the configuration again, as on SIGHUP.",
+                           "Apps which stay keep running, instances of apps",
+                           "which are gone are killed. Handles obtained before",
+                           "are rejected from then on." } } },
+    { "stats",  command{ cmd_stats,
+                         {},
+                         { "Print counters of the daemon, ‹KEY: VALUE› per line:",
+                           "apps, clients, open logs, and the compression of",
+                           "rotated logs: those waiting for its queue, queued,",
+                           "being compressed, and done." } } },
     { "signal", command{ cmd_signal,
-                         { "APP", "SIGNAL"},
-                         { "Send given signal to given running app." } } },
+                         { "APP...|--all|-l SELECTOR", "SIGNAL"},
+                         { "Send given signal to given running app,",
+                           "or to each app given, or to --all running apps,",
+                           "or to those running and matching the selector." } } },
+    { "wait",   command{ cmd_wait,
+                         { "APP", "STATE", "[TIMEOUT]" },
+                         { "Wait until the app is in the given state, which is",
+                           "‹running›, ‹exited›, or ‹exited:CODE› for an exit",
+                           "with that return value. Fails if the app exits",
+                           "otherwise, or if TIMEOUT seconds pass first." } } },
+    { "watch",  command{ cmd_watch,
+                         { "[APP...]" },
+                         { "Stream events of the given apps, or of all of them,",
+                           "as they happen, one per line: ‹started›, ‹exited›,",
+                           "‹updated› and ‹signalled›, followed by the app.",
+                           "Events a slow client cannot take in time are",
+                           "dropped, and their count reported as ‹dropped N›." } } },
     // TODO:
     // { "status", command{ cmd_status, {}, {} } },
     // { "signal", command{ cmd_status, {}, {} } },
@@ -56,8 +146,22 @@ const char* CONF_FMT_EX = R"RAW_STRING(
 "APP_NAME": {
     "dir": "/ABS/PATH/TO/DIR",
     "start": "[CMD] /ABS/PATH/TO/EXECUTABLE",
-    "update": "UPDATE CMD"
+    "update": "UPDATE CMD",
+    "labels": { "KEY": "VALUE" },
+    "tags": [ "TAG" ],
+    "inherit": [ 3 ],
+    "timestamps": false,
+    "rotate": { "max_size": BYTES, "max_age": SECONDS, "keep": 5,
+                "compress": LEVEL }
 }
+
+Labels and tags are optional, a tag is a label with no value. Inherit lists
+fds of srvd, above 2, the app is started with, it gets no others. With
+timestamps, each line of the logs starts with the time it was written.
+Logs are appended to, and rotated once larger than max_size or older than
+max_age, if given, keeping the last ‹keep› as ‹LOG.1› (newest) to ‹LOG.N›.
+With compress, 1 (fastest) to 9 (smallest), rotated logs are gzipped into
+‹LOG.N.gz› in the background, unless rotated past ‹keep› before their turn.
 )RAW_STRING";
 
 
@@ -78,6 +182,14 @@ void print_help(const char* program)
         std::printf("\n");
     }
 
+    std::printf("%s batch [-f ‹FILE›]\n"
+                "    Read commands from stdin or a file, one per line,\n"
+                "    and send them all over a single connection.\n"
+                "    Results are printed as they arrive, the exit status\n"
+                "    is non-zero if any of the commands failed. Lines\n"
+                "    which are not valid fail without being sent.\n"
+                "\n", program);
+
     std::printf("CONFIGURATION FORMAT\n\n");
     std::printf("The configuration is located in ‹%s›.\n"
                 "It uses the ‹json› format. Each application entry should\n"
@@ -86,145 +198,1111 @@ void print_help(const char* program)
 }
 
 
-message cmd_start(const message& msg, server_t& server)
+// Finds the app a request refers to, by its name, or by its handle
+// ‹@EPOCH:ID› from ‹resolve› or ‹list --json›. Returns the reply to give
+// if there is no such app.
+static std::optional<message> find_app(const server_t& server, const char* arg,
+                                       app_id& id)
 {
-    const auto& arg = msg.line(0);
-    auto it = server.apps.find(arg);
+    const auto& apps = server.apps;
 
-    if (it == server.apps.end())
+    id = apps.find(arg);
+    if (id != registry_t::none)
+        return {};
+
+    if (arg[0] != '@')
         return message{ "error", "invalid app name '%s'", arg };
 
-    char* const* argv = it->second.start.get();
-    const auto& dir = it->second.dir;
+    char* end = nullptr;
+    auto epoch = std::strtoull(arg + 1, &end, 10);
+    bool valid = std::isdigit((unsigned char) arg[1]) && *end == ':'
+              && std::isdigit((unsigned char) end[1]);
+    auto num = valid ? std::strtoull(end + 1, &end, 10) : 0;
+
+    if (!valid || *end != '\0')
+        return message{ "error", "invalid handle '%s'", arg };
+    if (epoch != apps.epoch)
+        return message{ "error", "stale handle '%s', the configuration "
+                                 "was reloaded", arg };
+    if (num >= apps.size())
+        return message{ "error", "invalid handle '%s'", arg };
+
+    id = app_id(num);
+    return {};
+}
+
 
-    auto redir = std::map<int, fs::path>
+// The apps a command applies to, given by the first ‹count› lines of the
+// request: apps by their names or handles, each once, ‹--all› of them, or
+// those matching ‹-l SELECTOR›. ‹selected› tells the latter two, which
+// skip the apps the command would fail for.
+static std::optional<message> find_apps(const server_t& server,
+                                        const message& msg, size_t count,
+                                        std::vector<app_id>& ids,
+                                        bool& selected)
+{
+    using namespace std::literals;
+
+    const auto& apps = server.apps;
+    const char* opt = msg.line(0);
+
+    selected = count == 1 && opt == "--all"sv;
+    if (selected)
     {
-        { fd_t::fileno(stdout), LOG_PATH / arg += ".stdout.log" },
-        { fd_t::fileno(stderr), LOG_PATH / arg += ".stderr.log" },
-    };
+        ids = apps.by_name();
+        return {};
+    }
 
-    auto to_close = std::vector<int>{ server.sock.fd };
+    selected = count == 2 && (opt == "-l"sv || opt == "--selector"sv);
+    if (selected)
+    {
+        if (!apps.select(msg.line(1), ids))
+            return message{ "error", "invalid selector '%s'", msg.line(1) };
 
-    const auto& [nit, succ] = server.procs.try_emplace(arg, argv, dir, redir,
-                                                       to_close);
-    if (!succ)
-        return message{ "error", "already running" };
+        std::sort(ids.begin(), ids.end(), [&](app_id a, app_id b)
+        {
+            return apps.name(a) < apps.name(b);
+        });
+        return {};
+    }
+
+    if (count == 0)
+        return message{ "error", "no app given" };
 
-    return message{ "ok", "pid: %d", int(nit->second.pid) };
+    auto seen = std::vector<bool>(apps.size());
+    for (size_t i = 0; i < count; ++i)
+    {
+        app_id id;
+        if (auto err = find_app(server, msg.line(i), id))
+            return err;
+        if (!seen[id])
+            ids.push_back(id);
+        seen[id] = true;
+    }
+    return {};
 }
 
 
-message cmd_stop(const message& msg, server_t& server)
+// The outcome of a command applied to many apps, answered at once with a
+// line ‹APP: RESULT› for each app. An app named alone is answered with its
+// result only, as by the command for a single app.
+struct bulk_t
 {
-    const auto& arg = msg.line(0);
+    struct result_t
+    {
+        bool ok;
+        std::string text;
+    };
 
-    auto it = server.procs.find(arg);
-    if (it == server.procs.end())
-        return message{ "error", "not running" };
+    server_t& server;
+    reply_t to;
+    bool single;
+    std::vector<std::string> names{};   // ids may change before the reply
+    std::vector<result_t> results{};
+    size_t pending = 0;                 // results yet to come
 
-    // TODO: first attempt to terminate peacefully
-    it->second.signal(SIGKILL);
-    server.reap(it);
+    // Returns the index of the result for the app.
+    size_t add(app_id id)
+    {
+        names.emplace_back(server.apps.name(id));
+        results.push_back(result_t{ false, {} });
+        ++pending;
+        return names.size() - 1;
+    }
 
-    return message{ "ok", "killed" };
-}
+    void set(size_t i, bool ok, std::string text)
+    {
+        results[i] = result_t{ ok, std::move(text) };
+        --pending;
+    }
 
+    message reply() const
+    {
+        bool ok = std::all_of(results.begin(), results.end(),
+                              [](const result_t& r) { return r.ok; });
+        auto resp = message{ ok ? "ok" : "error" };
 
-message cmd_update(const message& msg, server_t& server)
-{
-    const auto& arg = msg.line(0);
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const auto& r = results[i];
+            if (single && !r.text.empty())
+                resp.add_raw(r.text.c_str(), r.text.size());
+            if (single)
+                continue;
 
-    auto app_it = server.apps.find(arg);
-    if (app_it == server.apps.end())
-        return message{ "error", "invalid app name '%s'", arg };
+            const auto& name = names[i];
+            resp.add_line("%.*s: %s", int(name.size()), name.data(),
+                          !r.text.empty() ? r.text.c_str()
+                                          : r.ok ? "ok" : "error");
+        }
+        return resp;
+    }
+};
 
-    auto resp = message{};
 
-    auto proc_it = server.procs.find(arg);
-    if (proc_it != server.procs.end())
+auto cmd_start(const message& msg, server_t& server, const reply_t& to)
+    -> std::optional<message>
+{
+    auto ids = std::vector<app_id>{};
+    bool selected;
+    if (auto err = find_apps(server, msg, msg.size(), ids, selected))
+        return err;
+
+    auto bulk = bulk_t{ server, to, !selected && ids.size() == 1 };
+
+    // forked one after another, the client waits for the whole batch once
+    for (app_id id : ids)
     {
-        // TODO: first attempt to terminate peacefully
-        proc_it->second.signal(SIGKILL);
-        server.reap(proc_it);
-        resp.add_line("killed");
+        if (selected && server.child(id))
+            continue;
+
+        size_t i = bulk.add(id);
+        const auto& app = server.apps.apps[id];
+        auto argv = app.start.get();
+        auto name = std::string{ server.apps.name(id) };
+
+        try
+        {
+            if (server.child(id))
+            {
+                bulk.set(i, false, "already running");
+                continue;
+            }
+
+            // the app writes into pipes of srvd, which fill the logs
+            auto out = server.logs.open(server.loop, LOG_PATH / name
+                                        += ".stdout.log", app.timestamps,
+                                        app.rotate);
+            auto err = server.logs.open(server.loop, LOG_PATH / name
+                                        += ".stderr.log", app.timestamps,
+                                        app.rotate);
+            auto dups = std::map<int, int>
+            {
+                { fd_t::fileno(stdout), out.fd },
+                { fd_t::fileno(stderr), err.fd },
+            };
+
+            server.spawn(id, argv.data(), app.dir, app.inherit, dups,
+                         server.exes.get(server.apps, id));
+            bulk.set(i, true, "pid: " + std::to_string(server.apps.pid[id]));
+        }
+        catch (const std::exception& e)
+        {
+            bulk.set(i, false, e.what());
+        }
     }
 
-    // TODO: interrupt if client dies when updating
-    // TODO: pipe update output and send to client
-    auto update = proc_t{ app_it->second.update.get(),
-                          app_it->second.dir };
-    auto ex = update.wait();
+    return bulk.reply();
+}
+
 
-    bool ok = false;
-    if (const auto* e = std::get_if<e_exit>(&ex))
-        ok = (e->ret == 0) || (resp.add_line("exit: %d", e->ret), false);
-    else if (const auto* s = std::get_if<e_sig>(&ex))
-        resp.add_line("signal: %d", s->sig);
+auto cmd_stop(const message& msg, server_t& server, const reply_t& to)
+    -> std::optional<message>
+{
+    auto ids = std::vector<app_id>{};
+    bool selected;
+    if (auto err = find_apps(server, msg, msg.size(), ids, selected))
+        return err;
 
-    resp.set_arg(ok ? "ok" : "error");
-    return resp;
+    auto bulk = std::make_shared<bulk_t>(bulk_t{ server, to,
+                                                 !selected && ids.size() == 1 });
+
+    // every app is signalled before any exit is waited for
+    for (app_id id : ids)
+    {
+        auto* child = server.child(id);
+        if (!child && selected)
+            continue;
+
+        size_t i = bulk->add(id);
+        if (!child)
+        {
+            bulk->set(i, false, "not running");
+            continue;
+        }
+
+        // TODO: first attempt to terminate peacefully
+        if (int err = child->proc.signal(SIGKILL))
+        {
+            bulk->set(i, false, std::strerror(err));
+            continue;
+        }
+
+        // answered once the exits arrive through the pidfds, other
+        // requests are served meanwhile
+        child->on_exit.push_back([bulk, i](const exit_t&)
+        {
+            bulk->set(i, true, "killed");
+            if (bulk->pending == 0)
+                bulk->server.finish(bulk->to, bulk->reply());
+        });
+    }
+
+    if (bulk->pending == 0)
+        return bulk->reply();
+    return {};
 }
 
 
-message cmd_list  (const message&, server_t& server)
+// Runs the update command of an app without blocking the daemon,
+// its output is streamed to the client as it is produced.
+struct update_t
 {
-    auto str_exit = [](const auto& ex)
+    server_t& server;
+    reply_t to;
+    std::string name;
+    proc_t proc;
+    fd_t out;
+    loop_t::id_t out_watch = loop_t::none;
+    loop_t::id_t proc_watch = loop_t::none;
+    std::string partial = {};
+
+    void read_output(bool flush)
     {
-        if (!ex)
-            return std::array<char, 256>{ "-" };
+        auto resp = message{ "output" };
+        constexpr size_t LongLine = 4096;
 
-        std::array<char, 256> res = { 0 };
+        char buf[4096];
+        ssize_t r;
+        while ((r = out.read(buf, sizeof(buf))) > 0)
+            partial.append(buf, r);
 
-        if (const auto* e = std::get_if<e_exit>(&*ex))
+        size_t pos = 0;
+        while (pos < partial.size())
         {
-            std::snprintf(res.data(), res.size(), "exit %d", e->ret);
+            size_t nl = partial.find('\n', pos);
+            if (nl == std::string::npos && !flush
+                    && partial.size() - pos < LongLine)
+                break;
+
+            size_t len = std::min(nl == std::string::npos
+                                    ? partial.size() - pos
+                                    : nl - pos,
+                                  LongLine);
+            resp.add_raw(partial.data() + pos, len);
+
+            pos += len;
+            if (pos < partial.size() && partial[pos] == '\n')
+                ++pos;
         }
-        else if (const auto* s = std::get_if<e_sig>(&*ex))
+        partial.erase(0, pos);
+
+        if (resp.size() != 0)
+            server.send(to, resp);
+
+        if (r == 0)
+            stop_reading();
+    }
+
+    void stop_reading()
+    {
+        server.loop.del(std::exchange(out_watch, loop_t::none));
+        out.close();
+    }
+
+    void finish()
+    {
+        server.loop.del(std::exchange(proc_watch, loop_t::none));
+
+        // everything the update wrote is already in the pipe
+        if (out)
         {
-            std::snprintf(res.data(), res.size(),
-                         "%s (%d): %s",
-                         str_sig(s->sig), s->sig, ::strsignal(s->sig));
+            read_output(true);
+            stop_reading();
         }
-        return res;
+
+        auto ex = proc.wait();
+        auto resp = message{};
+
+        bool ok = false;
+        if (const auto* e = std::get_if<e_exit>(&ex))
+            ok = (e->ret == 0) || (resp.add_line("exit: %d", e->ret), false);
+        else if (const auto* s = std::get_if<e_sig>(&ex))
+            resp.add_line("signal: %d", s->sig);
+
+        resp.set_arg(ok ? "ok" : "error");
+        // by name, the app may be gone from a reloaded configuration
+        auto id = server.apps.find(name);
+        if (id != registry_t::none)
+            server.emit(id, "updated", "%s", ok ? "ok" : resp.line(0));
+        server.finish(to, resp);
+    }
+
+    void cancel()
+    {
+        server.loop.del(std::exchange(proc_watch, loop_t::none));
+        if (out)
+            stop_reading();
+
+        // proc_t kills the update's process group, with whatever the
+        // update started, and reaps it on destruction
+    }
+};
+
+
+auto run_update(server_t& server, const reply_t& to, const std::string& name,
+                const app_t& app) -> std::optional<message>
+{
+    int pipefd[2];
+    if (::pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) == -1)
+        return message{ "error", "pipe: %s", std::strerror(errno) };
+
+    fd_t out = pipefd[0];
+    fd_t in = pipefd[1];
+
+    // the write end must block, the update does not expect EAGAIN
+    ::fcntl(in.fd, F_SETFL, 0);
+
+    auto dups = std::map<int, int>
+    {
+        { fd_t::fileno(stdout), in.fd },
+        { fd_t::fileno(stderr), in.fd },
     };
+    // also run once a stopped app exits, where nothing would catch
+    auto proc = std::optional<proc_t>{};
+    try
+    {
+        proc.emplace(app.update.get().data(), app.dir, std::vector<int>{},
+                     dups, exe_t{}, true);
+    }
+    catch (const std::exception& e)
+    {
+        return message{ "error", e.what() };
+    }
+    in.close();
+
+    auto update = std::make_shared<update_t>(update_t{
+        server, to, name, std::move(*proc), std::move(out) });
+
+    update->out_watch = server.loop.add(update->out.fd, EPOLLIN,
+                                        [update](uint32_t)
+    {
+        update->read_output(false);
+    });
+
+    update->proc_watch = server.loop.add(update->proc.pidfd.fd, EPOLLIN,
+                                         [update](uint32_t)
+    {
+        update->finish();
+    });
+
+    server.on_close(to, [update]() { update->cancel(); });
+
+    return {};
+}
+
+
+auto cmd_update(const message& msg, server_t& server, const reply_t& to)
+    -> std::optional<message>
+{
+    app_id id;
+    if (auto err = find_app(server, msg.line(0), id))
+        return err;
+
+    auto name = std::string{ server.apps.name(id) };
+
+    auto* child = server.child(id);
+    if (!child)
+        return run_update(server, to, name, server.apps.apps[id]);
+
+    // TODO: first attempt to terminate peacefully
+    if (int err = child->proc.signal(SIGKILL))
+        return message{ "error", "kill: %s", std::strerror(err) };
+
+    child->on_exit.push_back([&server, to, name](const exit_t&)
+    {
+        // nobody to run the update for any more
+        if (!server.waiting(to))
+            return;
+
+        server.send(to, message{ "output", "killed" });
+
+        auto id = server.apps.find(name);
+        if (id == registry_t::none)
+            return server.finish(to, message{ "error", "app removed" });
+
+        if (auto resp = run_update(server, to, name, server.apps.apps[id]))
+            server.finish(to, *resp);
+    });
+
+    return {};
+}
+
+
+static std::array<char, 256> str_exit(const std::optional<exit_t>& ex)
+{
+    if (!ex)
+        return std::array<char, 256>{ "-" };
+
+    std::array<char, 256> res = { 0 };
+
+    if (const auto* e = std::get_if<e_exit>(&*ex))
+    {
+        std::snprintf(res.data(), res.size(), "exit %d", e->ret);
+    }
+    else if (const auto* s = std::get_if<e_sig>(&*ex))
+    {
+        std::snprintf(res.data(), res.size(),
+                     "%s (%d): %s",
+                     str_sig(s->sig), s->sig, ::strsignal(s->sig));
+    }
+    return res;
+}
 
-    auto resp = message{ "ok" };
 
+void list_header(message& resp)
+{
     resp.add_line("%-20s │ %10s │ %20s", "APP", "PID", "EXIT");
     resp.add_line("%-20s─┼─%10s─┼─%20s", "────────────────────", "──────────",
                                          "────────────────────");
-    for (const auto& [key, app] : server.apps)
+}
+
+
+void list_row(message& resp, const char* name, int pid,
+              const std::optional<exit_t>& ex)
+{
+    if (pid != -1)
+        resp.add_line("%-20s │ %10d │ %-20s", name, pid, str_exit(ex).data());
+    else
+        resp.add_line("%-20s │ %10s │ %-20s", name, "-", str_exit(ex).data());
+}
+
+
+// An app selected by ‹list›, before it is formatted.
+struct list_entry
+{
+    app_id id;
+    std::string_view name;
+    const app_t* app;
+    int pid;                            // -1 unless running
+    const std::optional<exit_t>* exit;
+};
+
+
+static json list_json(const registry_t& apps, const list_entry& e)
+{
+    auto res = json{
+        { "name", e.name },
+        { "handle", apps.handle(e.id) },
+        { "state", e.pid != -1 ? "running" : "stopped" },
+        { "pid", e.pid != -1 ? json(e.pid) : json() },
+        { "exit", json() },
+        { "started", e.app->started != 0 ? json(e.app->started) : json() },
+        { "restarts", e.app->starts > 0 ? e.app->starts - 1 : 0 },
+        { "generation", e.app->gen },
+        { "usage", json() },
+    };
+
+    if (const auto* ex = *e.exit ? &**e.exit : nullptr)
+    {
+        if (const auto* x = std::get_if<e_exit>(ex))
+            res["exit"] = { { "code", x->ret } };
+        else if (const auto* s = std::get_if<e_sig>(ex))
+            res["exit"] = { { "signal", s->sig }, { "name", str_sig(s->sig) } };
+    }
+
+    auto labels = json::object();
+    for (const auto& [k, v] : e.app->labels)
+        labels[k] = v;
+    res["labels"] = std::move(labels);
+
+    if (const auto& ru = e.app->usage)
+        res["usage"] = { { "user_ms", ru->user_ms },
+                         { "system_ms", ru->system_ms },
+                         { "max_rss_kb", ru->max_rss_kb } };
+    return res;
+}
+
+
+// A ‹list› in progress. Rows are produced in chunks, each sent as a partial
+// reply once the client has taken the previous ones, so a large registry is
+// never formatted into a single message. Apps are walked in the order of
+// names from a cursor, or in an order sorted beforehand.
+struct list_t
+{
+    // rows of a chunk, and bytes left unread by the client, to go on
+    static constexpr size_t ChunkRows = 256;
+    static constexpr size_t Backlog = conn_t::TxLimit / 4;
+
+    server_t& server;
+    reply_t to;
+    std::uint32_t epoch;                    // of the ids below
+
+    std::optional<std::uint64_t> since{};
+    bool as_json = false;
+    std::optional<std::string> state{};
+    std::optional<std::string> glob{};
+    std::string sort = "name";
+    size_t limit = SIZE_MAX;
+
+    std::vector<app_id> order{};            // if ‹ordered›
+    bool ordered = false;                   // rather than all apps by name
+    size_t pos = 0;                         // the cursor, in the order
+    app_id last = registry_t::none;         // the last app selected
+
+    message chunk{ "ok" };
+    size_t rows = 0;                        // in total
+    bool streamed = false;                  // some chunks went as partials
+
+    std::optional<list_entry> select(app_id id) const
+    {
+        const auto& apps = server.apps;
+        const auto& app = apps.apps[id];
+
+        if (since && app.gen <= *since)
+            return {};
+
+        // names are stored with a terminating '\0'
+        auto name = apps.name(id);
+        if (glob && ::fnmatch(glob->c_str(), name.data(), 0) != 0)
+            return {};
+
+        int pid = apps.pid[id];
+        if (state && (*state == "running") != (pid != -1))
+            return {};
+
+        return list_entry{ id, name, &app, pid, &apps.exit[id] };
+    }
+
+    // The next app to list, after the cursor.
+    std::optional<list_entry> next()
+    {
+        const auto& ids = ordered ? order : server.apps.by_name();
+        while (pos < ids.size())
+        {
+            last = ids[pos++];
+            if (auto e = select(last))
+                return e;
+        }
+        return {};
+    }
+
+    // Sorts the apps selected out of ‹ids›, given in the order of names,
+    // by ids only, the rows are formatted as they are sent.
+    void prepare(const std::vector<app_id>& ids)
     {
-        auto it = server.procs.find(key);
-        if (it != server.procs.end())
+        for (app_id id : ids)
+            if (select(id))
+                order.push_back(id);
+        ordered = true;
+
+        const auto& apps = server.apps;
+        auto by = [&](auto key)
         {
-            resp.add_line("%-20s │ %10d │ %-20s", key.c_str(), it->second.pid,
-                                                 str_exit(app.exit).data());
+            std::stable_sort(order.begin(), order.end(),
+                             [&](app_id a, app_id b)
+            {
+                return key(a) < key(b);
+            });
+        };
+        if (sort == "pid")
+            by([&](app_id id) { return apps.pid[id]; });
+        else if (sort == "started")
+            by([&](app_id id) { return apps.apps[id].started; });
+        else if (sort == "restarts")
+            by([&](app_id id) { return apps.apps[id].starts; });
+    }
+
+    // The current generation, ‹BOOT:N›, for a later ‹--since›.
+    std::string generation() const
+    {
+        return std::to_string(server.boot) + ":"
+             + std::to_string(server.generation);
+    }
+
+    void head()
+    {
+        if (as_json)
+            return;
+
+        if (since)
+            chunk.add_line("generation: %s", generation().c_str());
+        list_header(chunk);
+    }
+
+    void row(const list_entry& e)
+    {
+        if (!as_json)
+            return list_row(chunk, e.name.data(), e.pid, *e.exit);
+
+        auto out = list_json(server.apps, e).dump();
+        chunk.add_raw(out.c_str(), out.size());
+    }
+
+    // ‹next› is the cursor to continue from, if the limit cut the list.
+    void tail(const std::optional<std::string>& next)
+    {
+        if (as_json)
+        {
+            auto out = json{ { "generation", generation() },
+                             { "next", next ? json(*next) : json() } }.dump();
+            chunk.add_raw(out.c_str(), out.size());
+        }
+        else if (next)
+        {
+            chunk.add_line("next: %s", next->c_str());
+        }
+    }
+
+    static void pump(const std::shared_ptr<list_t>& self)
+    {
+        auto& l = *self;
+        while (true)
+        {
+            if (l.server.apps.epoch != l.epoch)
+                return l.server.finish(l.to, message{ "error",
+                            "the configuration was reloaded, list again" });
+
+            if (l.server.backlog(l.to.conn) >= Backlog)
+                return l.server.on_drain(l.to.conn, [self]() { pump(self); });
+
+            size_t in_chunk = 0;
+            while (in_chunk < ChunkRows && l.rows < l.limit)
+            {
+                auto e = l.next();
+                if (!e)
+                    return l.finish({});
+
+                l.row(*e);
+                ++in_chunk;
+                ++l.rows;
+            }
+
+            if (l.rows == l.limit)
+            {
+                // continue from the last one listed, if any remain, only
+                // the order of names has a cursor
+                auto name = std::string{ l.server.apps.name(l.last) };
+                bool more = l.sort == "name" && l.next();
+                return l.finish(more ? std::optional{ name } : std::nullopt);
+            }
+
+            l.streamed = true;
+            l.server.send(l.to, std::exchange(l.chunk, message{ "ok" }));
+        }
+    }
+
+    void finish(const std::optional<std::string>& next)
+    {
+        // a streamed list does not end with rows, a client printing the
+        // final reply last would put them after its status
+        if (streamed && chunk.size() != 0)
+            server.send(to, std::exchange(chunk, message{ "ok" }));
+
+        tail(next);
+        server.finish(to, std::exchange(chunk, message{ "ok" }));
+    }
+};
+
+
+auto cmd_list(const message& msg, server_t& server, const reply_t& to)
+    -> std::optional<message>
+{
+    using namespace std::literals;
+
+    auto list = std::make_shared<list_t>(list_t{ server, to,
+                                                 server.apps.epoch });
+    const char* after = nullptr;
+    const char* selector = nullptr;
+
+    for (size_t i = 0; i < msg.size(); ++i)
+    {
+        const char* opt = msg.line(i);
+        bool has_val = i + 1 < msg.size();
+
+        if (opt == "--json"sv)
+        {
+            list->as_json = true;
+        }
+        else if (opt == "--since"sv && has_val)
+        {
+            const char* val = msg.line(++i);
+            char* end;
+            auto boot = std::strtoull(val, &end, 10);
+            bool valid = end != val && *end == ':'
+                      && std::isdigit((unsigned char) end[1]);
+            list->since = valid ? std::strtoull(end + 1, &end, 10) : 0;
+            if (!valid || *end != '\0')
+                return message{ "error", "invalid generation '%s'", val };
+
+            // counted by another run of the daemon, everything is new
+            if (boot != server.boot)
+                list->since = 0;
+        }
+        else if (opt == "--state"sv && has_val)
+        {
+            list->state = msg.line(++i);
+            if (list->state != "running" && list->state != "stopped")
+                return message{ "error", "invalid state '%s'",
+                                list->state->c_str() };
+        }
+        else if (opt == "--name"sv && has_val)
+        {
+            list->glob = msg.line(++i);
+        }
+        else if (opt == "--sort"sv && has_val)
+        {
+            list->sort = msg.line(++i);
+            if (list->sort != "name" && list->sort != "pid"
+                    && list->sort != "started" && list->sort != "restarts")
+                return message{ "error", "invalid sort key '%s'",
+                                list->sort.c_str() };
+        }
+        else if (opt == "--limit"sv && has_val)
+        {
+            const char* val = msg.line(++i);
+            char* end;
+            list->limit = std::strtoull(val, &end, 10);
+            if (end == val || *end != '\0' || list->limit == 0)
+                return message{ "error", "invalid limit '%s'", val };
+        }
+        else if (opt == "--after"sv && has_val)
+        {
+            after = msg.line(++i);
+        }
+        else if ((opt == "-l"sv || opt == "--selector"sv) && has_val)
+        {
+            selector = msg.line(++i);
         }
         else
         {
-            resp.add_line("%-20s │ %10s │ %-20s", key.c_str(), "-",
-                                                 str_exit(app.exit).data());
+            return message{ "error", "invalid option '%s'", opt };
         }
     }
-    return resp;
+
+    if (after && list->sort != "name")
+        return message{ "error", "--after needs the list sorted by name" };
+
+    const auto& apps = server.apps;
+    if (selector)
+    {
+        // only the apps selected are sorted, through the index of labels
+        auto ids = std::vector<app_id>{};
+        if (!apps.select(selector, ids))
+            return message{ "error", "invalid selector '%s'", selector };
+
+        std::sort(ids.begin(), ids.end(), [&](app_id a, app_id b)
+        {
+            return apps.name(a) < apps.name(b);
+        });
+        list->prepare(ids);
+    }
+    else if (list->sort != "name")
+    {
+        list->prepare(apps.by_name());
+    }
+
+    if (after && list->ordered)
+        list->pos = std::upper_bound(list->order.begin(), list->order.end(),
+                                     std::string_view{ after },
+                                     [&](std::string_view k, app_id id)
+        {
+            return k < apps.name(id);
+        }) - list->order.begin();
+    else if (after)
+        list->pos = apps.after(after);
+
+    list->head();
+    list_t::pump(list);
+    return {};
 }
 
 
-message cmd_signal(const message& msg, server_t& server)
+auto cmd_signal(const message& msg, server_t& server, const reply_t& to)
+    -> std::optional<message>
 {
-    const auto& sig = msg.line(1);
-    const auto& arg = msg.line(0);
+    if (msg.size() < 2)
+        return message{ "error", "no app or signal given" };
+
+    const auto& sig = msg.line(msg.size() - 1);
 
-    auto it = server.procs.find(arg);
-    if (it == server.procs.end())
-        return message{ "error", "'%s' not running", arg };
+    auto ids = std::vector<app_id>{};
+    bool selected;
+    if (auto err = find_apps(server, msg, msg.size() - 1, ids, selected))
+        return err;
 
     int s = int_sig(sig);
     if (s == -1)
         return message{ "error", "invalid signal '%s'", sig };
 
-    it->second.signal(s);
+    auto bulk = bulk_t{ server, to, !selected && ids.size() == 1 };
+    for (app_id id : ids)
+    {
+        auto* child = server.child(id);
+        if (!child && selected)
+            continue;
+
+        size_t i = bulk.add(id);
+        if (!child)
+        {
+            auto name = std::string{ server.apps.name(id) };
+            bulk.set(i, false, bulk.single ? "'" + name + "' not running"
+                                           : "not running");
+            continue;
+        }
+
+        if (int err = child->proc.signal(s))
+        {
+            bulk.set(i, false, std::strerror(err));
+            continue;
+        }
+        server.emit(id, "signalled", "%s", str_sig(s));
+        bulk.set(i, true, {});
+    }
+
+    return bulk.reply();
+}
+
+
+auto cmd_watch(const message& msg, server_t& server, const reply_t& to)
+    -> std::optional<message>
+{
+    auto watcher = watcher_t{ to };
+    if (msg.size() != 0)
+        watcher.apps.emplace();
+
+    for (size_t i = 0; i < msg.size(); ++i)
+    {
+        app_id id;
+        if (auto err = find_app(server, msg.line(i), id))
+            return err;
+        watcher.apps->emplace(id);
+    }
+
+    auto key = std::make_pair(to.conn, to.id);
+    server.watchers.emplace(key, std::move(watcher));
 
-    return { "ok" };
+    // never answered, the stream ends with the connection
+    server.on_close(to, [&server, key]() { server.watchers.erase(key); });
+
+    return {};
+}
+
+
+// A ‹wait› request parked until its app reaches the state, or it times out.
+struct wait_t
+{
+    server_t& server;
+    reply_t to;
+    std::optional<int> code;    // of the exit waited for, if any
+    fd_t timer{ -1 };
+    loop_t::id_t timer_watch = loop_t::none;
+    std::optional<decltype(server_t::on_start)::iterator> start_hook{};
+    bool done = false;
+
+    void resolve(message resp)
+    {
+        if (std::exchange(done, true))
+            return;
+
+        release();
+        server.finish(to, std::move(resp));
+    }
+
+    // The answer to a wait for an exit, optionally with the ‹code›.
+    static message exit_reply(const exit_t& ex, std::optional<int> code)
+    {
+        auto resp = message{};
+
+        bool ok = true;
+        if (const auto* e = std::get_if<e_exit>(&ex))
+        {
+            resp.add_line("exit: %d", e->ret);
+            ok = !code || *code == e->ret;
+        }
+        else if (const auto* s = std::get_if<e_sig>(&ex))
+        {
+            resp.add_line("signal: %d", s->sig);
+            ok = !code;
+        }
+
+        resp.set_arg(ok ? "ok" : "error");
+        return resp;
+    }
+
+    // the hooks on the child stay, they find the wait done
+    void release()
+    {
+        server.loop.del(std::exchange(timer_watch, loop_t::none));
+        timer.close();
+
+        if (start_hook)
+            server.on_start.erase(*std::exchange(start_hook, std::nullopt));
+    }
+
+    void cancel()
+    {
+        done = true;
+        release();
+    }
+};
+
+
+auto cmd_wait(const message& msg, server_t& server, const reply_t& to)
+    -> std::optional<message>
+{
+    using namespace std::literals;
+
+    const auto& state = msg.line(1);
+
+    app_id id;
+    if (auto err = find_app(server, msg.line(0), id))
+        return err;
+
+    bool running = false;
+    auto code = std::optional<int>{};
+
+    if (state == "running"sv)
+        running = true;
+    else if (std::strncmp(state, "exited:", 7) == 0)
+    {
+        char* end;
+        code = std::strtol(state + 7, &end, 10);
+        if (end == state + 7 || *end != '\0')
+            return message{ "error", "invalid exit code '%s'", state + 7 };
+    }
+    else if (state != "exited"sv)
+        return message{ "error", "invalid state '%s'", state };
+
+    double timeout = -1;
+    if (msg.size() > 2)
+    {
+        char* end;
+        timeout = std::strtod(msg.line(2), &end);
+        if (end == msg.line(2) || *end != '\0' || !std::isfinite(timeout)
+                || timeout < 0)
+            return message{ "error", "invalid timeout '%s'", msg.line(2) };
+    }
+
+    auto* child = server.child(id);
+
+    // the condition may hold already
+    if (running && child)
+        return message{ "ok", "pid: %d", int(server.apps.pid[id]) };
+
+    if (!running && !child)
+    {
+        const auto& ex = server.apps.exit[id];
+        if (!ex)
+            return code ? message{ "error", "not running" }
+                        : message{ "ok" };
+
+        return wait_t::exit_reply(*ex, code);
+    }
+
+    auto wait = std::make_shared<wait_t>(wait_t{ server, to, code });
+
+    if (running)
+    {
+        auto name = std::string{ server.apps.name(id) };
+        wait->start_hook = server.on_start.emplace(name, [wait](pid_t pid)
+        {
+            wait->start_hook.reset();   // erased by the caller
+
+            if (pid == -1)
+                return wait->resolve(message{ "error", "app removed" });
+            wait->resolve(message{ "ok", "pid: %d", int(pid) });
+        });
+    }
+    else
+    {
+        child->on_exit.push_back([wait](const exit_t& ex)
+        {
+            wait->resolve(wait_t::exit_reply(ex, wait->code));
+        });
+    }
+
+    if (timeout >= 0)
+    {
+        wait->timer = ::timerfd_create(CLOCK_MONOTONIC,
+                                       TFD_NONBLOCK | TFD_CLOEXEC);
+        if (!wait->timer)
+        {
+            wait->cancel();
+            return message{ "error", "timerfd: %s", std::strerror(errno) };
+        }
+
+        auto spec = itimerspec{};
+        spec.it_value.tv_sec = time_t(timeout);
+        spec.it_value.tv_nsec = long((timeout - time_t(timeout)) * 1e9);
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;  // zero would disarm the timer
+        ::timerfd_settime(wait->timer.fd, 0, &spec, nullptr);
+
+        wait->timer_watch = server.loop.add(wait->timer.fd, EPOLLIN,
+                                            [wait](uint32_t)
+        {
+            wait->resolve(message{ "error", "timeout" });
+        });
+    }
+
+    server.on_close(to, [wait]() { wait->cancel(); });
+
+    return {};
+}
+
+
+auto cmd_resolve(const message& msg, server_t& server, const reply_t&)
+    -> std::optional<message>
+{
+    if (msg.size() == 0)
+        return message{ "error", "no app given" };
+
+    auto resp = message{ "ok" };
+    for (size_t i = 0; i < msg.size(); ++i)
+    {
+        app_id id;
+        if (auto err = find_app(server, msg.line(i), id))
+            return err;
+
+        auto handle = server.apps.handle(id);
+        resp.add_raw(handle.c_str(), handle.size());
+    }
+    return resp;
+}
+
+
+auto cmd_reload(const message&, server_t& server, const reply_t&)
+    -> std::optional<message>
+{
+    if (auto err = server.reload())
+        return message{ "error", err->c_str() };
+    return message{ "ok", "apps: %llu",
+                    (unsigned long long) server.apps.size() };
+}
+
+
+auto cmd_stats(const message&, server_t& server, const reply_t&)
+    -> std::optional<message>
+{
+    auto resp = message{ "ok" };
+    auto line = [&resp](const char* key, unsigned long long val)
+    {
+        char buf[64];
+        int len = std::snprintf(buf, sizeof(buf), "%s: %llu", key, val);
+        resp.add_raw(buf, len);
+    };
+
+    size_t running = 0;
+    for (size_t id = 0; id < server.apps.size(); ++id)
+        running += server.child(id) != nullptr;
+
+    auto gz = server.logs.compressor.stats();
+    line("apps", server.apps.size());
+    line("running", running);
+    line("clients", server.conns.size());
+    line("log pipes", server.logs.pipes.size());
+    line("log files", server.logs.files.size());
+    line("compress threads", gz.threads);
+    line("compress waiting", server.logs.waiting());
+    line("compress queued", gz.queued);
+    line("compress max queue", gz.max_queue);
+    line("compress active", gz.active);
+    line("compress done", gz.done);
+    line("compress failed", gz.failed);
+    line("compress refused", gz.refused);
+    line("compress cancelled", gz.cancelled);
+    line("compress bytes in", gz.bytes_in);
+    line("compress bytes out", gz.bytes_out);
+    return resp;
 }
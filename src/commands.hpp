@@ -2,16 +2,21 @@
 
 // headers
 #include "message.hpp"  // message
-#include "common.hpp"   // app_t, server_t
+#include "common.hpp"   // app_t
+#include "server.hpp"   // server_t, reply_t
 #include "proc.hpp"     // proc
 
 // cpp
 #include <map>          // map
 #include <vector>       // vector
 #include <filesystem>   // fs::*
+#include <optional>     // optional
 
 
-using cmd_ptr = message (*) (const message&, server_t&);
+// Returns the reply, or nothing if the command answers later through
+// server_t::send/finish.
+using cmd_ptr = std::optional<message> (*) (const message&, server_t&,
+                                            const reply_t&);
 
 
 struct command
@@ -27,3 +32,10 @@ extern const std::map<std::string, command> COMMANDS;
 
 void print_help(const char* program);
 
+
+// The table printed by ‹list›, shared by the daemon and by srvctl reading
+// the status page. ‹pid› is -1 unless the app is running.
+void list_header(message& resp);
+void list_row(message& resp, const char* name, int pid,
+              const std::optional<exit_t>& ex);
+
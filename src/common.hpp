@@ -12,28 +12,36 @@
 #include <unistd.h>     // getuid
 #include <sys/types.h>  // getuid, getpwuid
 #include <pwd.h>        //         getpwuid
+#include <sys/resource.h> // rusage
 
 // c
 #include <cstdio>       // printf
 #include <cstring>      // strncpy, strncat
+#include <cstdint>      // int64_t, uint32_t, uint64_t
 
 // cpp
 #include <map>          // map
 #include <filesystem>   // fs::*
 #include <utility>      // move
-#include <algorithm>    // count
+#include <algorithm>    // count, replace
 #include <optional>     // optional
 #include <stdexcept>    // runtime_error
+#include <string>       // string
+#include <vector>       // vector
 
 
-constexpr int MAX_CLIENTS = 5;
+constexpr int MAX_CLIENTS = 64;    // default limit of concurrent connections
+constexpr int COMPRESS_THREADS = 1; // default number of log compressors
+constexpr int COMPRESS_QUEUE = 64;  // default bound of the compressor's queue
 
 
 inline const auto CONF = std::filesystem::path{ ".apps.json" };
 inline const auto SOCK = std::filesystem::path{ ".socket" };
+inline const auto STAT = std::filesystem::path{ ".status" };
 
 inline auto CONF_PATH = std::filesystem::path{};
 inline auto SOCK_PATH = std::filesystem::path{};
+inline auto STAT_PATH = std::filesystem::path{};
 inline auto LOG_PATH  = std::filesystem::path{};
 
 
@@ -50,6 +58,7 @@ inline void setup_paths(bool log = false)
     auto dir = home / ".srvctl";
     CONF_PATH = dir / CONF;
     SOCK_PATH = dir / SOCK;
+    STAT_PATH = dir / STAT;
     LOG_PATH  = dir;
 
     if (!fs::is_regular_file(CONF_PATH))
@@ -61,64 +70,86 @@ inline void setup_paths(bool log = false)
 }
 
 
+// Arguments separated by '\0', in a single buffer. The array of pointers
+// for exec is made when it is needed, it is not kept with every app.
 struct argv_t
 {
     std::string data;
-    std::vector<char*> ptrs;
-
-    char* const* get() const { return ptrs.data(); }
 
     argv_t(std::string str) : data(std::move(str))
     {
-        ptrs.reserve(2 + std::count(data.begin(), data.end(), ' '));
+        std::replace(data.begin(), data.end(), ' ', '\0');
+    }
 
-        ptrs.push_back(&data[0]);
+    // Points into ‹data›, valid while the argv_t is not changed.
+    std::vector<char*> get() const
+    {
+        auto ptrs = std::vector<char*>{};
+        ptrs.reserve(2 + std::count(data.begin(), data.end(), '\0'));
 
+        // exec does not write to its arguments
+        char* str = const_cast<char*>(data.c_str());
+
+        ptrs.push_back(str);
         for (size_t i = 0; i < data.size(); i++)
         {
-            if (data[i] == ' ')
-            {
-                data[i] = '\0';
-                ptrs.push_back(&data[i + 1]);   // +1 doesn't cause problems,
-            }                                   // because std::string will
-        }                                       // contain terminating null
+            if (data[i] == '\0')
+                ptrs.push_back(str + i + 1);    // +1 doesn't cause problems,
+        }                                       // because std::string will
+                                                // contain terminating null
         ptrs.push_back(nullptr);
+        return ptrs;
     }
 };
 
 
-struct app_t
+// Resources used by a run of an app, as far as they are reported.
+struct usage_t
 {
-    std::filesystem::path dir;
-    argv_t start;
-    argv_t update;
-    std::optional<decltype(std::declval<proc_t>().wait())> exit{};
+    std::int64_t user_ms;
+    std::int64_t system_ms;
+    std::int64_t max_rss_kb;
+
+    usage_t(const struct rusage& ru)
+        : user_ms(ms(ru.ru_utime))
+        , system_ms(ms(ru.ru_stime))
+        , max_rss_kb(ru.ru_maxrss)
+    { }
+
+private:
+    static std::int64_t ms(const struct timeval& tv)
+    {
+        return std::int64_t(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+    }
 };
 
 
-struct server_t
+// When the logs of an app are rotated, 0 for never; a rotated log is kept
+// as ‹LOG.1›, the one before as ‹LOG.2›, and so on up to ‹keep›.
+struct rotate_t
 {
-    std::map<std::string, proc_t> procs;
-    std::map<std::string, app_t> apps;
-    fd_t sock{ -1 };
+    std::uint64_t max_size = 0;     // bytes
+    std::int64_t max_age = 0;       // seconds
+    unsigned keep = 5;
+    int compress = 0;               // gzip level of ‹LOG.N.gz›, 0 for none
+};
 
-    auto reap(decltype(procs)::iterator it)
-    {
-        auto& proc = it->second;
-        auto ex = proc.wait();
-        apps.at(it->first).exit = ex;
-        return procs.erase(it);
-    }
 
-    void reap_zombies()
-    {
-        for (auto it = procs.begin(); it != procs.end(); )
-        {
-            auto& proc = it->second;
-            if (proc.zombie())
-                it = reap(it);
-            else
-                ++it;
-        }
-    }
+struct app_t
+{
+    std::string dir;                // fs::path would keep its components
+    argv_t start;                   // on the heap
+    argv_t update;
+    std::int64_t started = 0;       // unix time of the last start
+    std::uint32_t starts = 0;
+    std::uint64_t gen = 0;          // server_t::generation of the last change
+    std::optional<usage_t> usage{}; // of the last run
+
+    // ‹KEY: VALUE›, sorted by key; a tag is a label with no value
+    std::vector<std::pair<std::string, std::string>> labels{};
+
+    // fds of the daemon the app is started with, it gets no other
+    std::vector<int> inherit{};
+    bool timestamps = false;        // of each line of the logs
+    rotate_t rotate{};
 };
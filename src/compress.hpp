@@ -0,0 +1,282 @@
+#pragma once
+
+// headers
+#include "gzip.hpp"     // gzip_t
+#include "fd.hpp"       // fd_t
+
+// posix
+#include <sys/eventfd.h> // eventfd
+#include <sys/resource.h> // setpriority
+#include <sys/syscall.h> // SYS_ioprio_set, SYS_gettid
+#include <fcntl.h>      // open
+#include <signal.h>     // sigfillset, pthread_sigmask
+#include <unistd.h>     // read, write, unlink, syscall
+
+// c
+#include <cerrno>       // errno
+#include <cstdint>      // uint64_t
+#include <cstring>      // strerror
+
+// cpp
+#include <algorithm>    // none_of
+#include <condition_variable> // condition_variable
+#include <deque>        // deque
+#include <mutex>        // mutex, lock_guard, unique_lock
+#include <set>          // set
+#include <stdexcept>    // runtime_error
+#include <string>       // string
+#include <thread>       // thread
+#include <utility>      // move, swap
+#include <vector>       // vector
+
+
+/*
+ * Compresses rotated logs in the background, on threads of the lowest
+ * priority, for the CPU and for the disk, so that the event loop never
+ * waits for it.
+ *
+ * A job reads a log it is given open and writes gzip into ‹tmp›, a file
+ * no one else uses. Where the result goes is left to the loop, as the log
+ * may have been rotated on since. ‹event› is readable once jobs are done,
+ * collect() tells which. The queue is bounded, a job beyond it is refused,
+ * to be submitted again once there is room. A job no longer wanted is
+ * cancelled, dropped from the queue, or abandoned by its worker.
+ */
+struct compressor_t
+{
+    struct job_t
+    {
+        std::uint64_t id;
+        fd_t in;
+        std::string tmp;
+        int level;
+    };
+
+    struct done_t
+    {
+        std::uint64_t id;
+        std::string error;      // empty if it is done
+    };
+
+    struct stats_t
+    {
+        size_t threads = 0;
+        size_t queued = 0;
+        size_t max_queue = 0;
+        size_t active = 0;
+        std::uint64_t done = 0;
+        std::uint64_t failed = 0;
+        std::uint64_t refused = 0;
+        std::uint64_t cancelled = 0;
+        std::uint64_t bytes_in = 0;
+        std::uint64_t bytes_out = 0;
+    };
+
+    fd_t event{ -1 };
+
+    compressor_t() = default;
+
+    compressor_t(const compressor_t&) = delete;
+    compressor_t& operator=(const compressor_t&) = delete;
+
+    // a job being done is abandoned
+    ~compressor_t()
+    {
+        {
+            auto lock = std::lock_guard{ mutex };
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    void start(unsigned threads, size_t max_queue)
+    {
+        event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (!event)
+            throw std::runtime_error("eventfd");
+
+        counters.threads = threads;
+        counters.max_queue = max_queue;
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back([this] { work(); });
+    }
+
+    bool running() const { return !workers.empty(); }
+
+    // Returns false if the queue is full. A job refused before is given
+    // ‹again›, so that it is counted as refused once.
+    bool submit(job_t job, bool again = false)
+    {
+        {
+            auto lock = std::lock_guard{ mutex };
+            if (queue.size() >= counters.max_queue)
+            {
+                counters.refused += again ? 0 : 1;
+                return false;
+            }
+            queue.push_back(std::move(job));
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    // Returns true if the job was still queued, it is not reported as done
+    // then; a job being done is reported, as failed if it was abandoned.
+    bool cancel(std::uint64_t id)
+    {
+        auto lock = std::lock_guard{ mutex };
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+        {
+            if (it->id != id)
+                continue;
+            queue.erase(it);
+            ++counters.cancelled;
+            return true;
+        }
+
+        // otherwise done already, or being done
+        if (std::none_of(finished.begin(), finished.end(),
+                         [id](const done_t& d) { return d.id == id; }))
+            cancelled.insert(id);
+        return false;
+    }
+
+    // The jobs done since the last call, once ‹event› is readable.
+    std::vector<done_t> collect()
+    {
+        std::uint64_t count;
+        while (event.read(reinterpret_cast<char*>(&count), sizeof(count)) > 0)
+            ;
+
+        auto res = std::vector<done_t>{};
+        auto lock = std::lock_guard{ mutex };
+        std::swap(res, finished);
+        return res;
+    }
+
+    stats_t stats() const
+    {
+        auto lock = std::lock_guard{ mutex };
+        auto res = counters;
+        res.queued = queue.size();
+        return res;
+    }
+
+private:
+    static constexpr size_t Chunk = 256 << 10;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<job_t> queue;
+    std::vector<done_t> finished;
+    std::vector<std::thread> workers;
+    std::set<std::uint64_t> cancelled;  // of jobs being done
+    stats_t counters;
+    bool stopping = false;
+
+    void work()
+    {
+        // signals are for the loop, by signalfd
+        sigset_t all;
+        ::sigfillset(&all);
+        ::pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        // both apply to the calling thread only; the idle class of I/O
+        // gets the disk only when no one else wants it
+        ::setpriority(PRIO_PROCESS, ::syscall(SYS_gettid), 19);
+        constexpr int IoprioWhoProcess = 1, IoprioClassIdle = 3;
+        ::syscall(SYS_ioprio_set, IoprioWhoProcess, 0, IoprioClassIdle << 13);
+
+        while (true)
+        {
+            auto lock = std::unique_lock{ mutex };
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+
+            auto job = std::move(queue.front());
+            queue.pop_front();
+            ++counters.active;
+            lock.unlock();
+
+            std::uint64_t in = 0, out = 0;
+            auto error = compress(job, in, out);
+
+            lock.lock();
+            --counters.active;
+            ++(error.empty() ? counters.done
+               : cancelled.erase(job.id) ? counters.cancelled
+                                         : counters.failed);
+            cancelled.erase(job.id);
+            counters.bytes_in += in;
+            counters.bytes_out += out;
+            finished.push_back(done_t{ job.id, std::move(error) });
+            lock.unlock();
+
+            std::uint64_t one = 1;
+            event.write(reinterpret_cast<const char*>(&one), sizeof(one));
+        }
+    }
+
+    // Returns why it failed, if it did.
+    std::string compress(job_t& job, std::uint64_t& in, std::uint64_t& out)
+    {
+        auto failed = [&job](const char* why)
+        {
+            ::unlink(job.tmp.c_str());
+            return "compress '" + job.tmp + "': " + why;
+        };
+
+        fd_t fd = ::open(job.tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC
+                                          | O_CLOEXEC, 0644);
+        if (!fd)
+            return failed(std::strerror(errno));
+
+        auto gz = gzip_t{ job.level };
+        auto buf = std::string(Chunk, '\0');
+        auto res = std::string{};
+        while (true)
+        {
+            {
+                auto lock = std::lock_guard{ mutex };
+                if (stopping)
+                    return failed("stopped");
+                if (cancelled.count(job.id) != 0)
+                    return failed("cancelled");
+            }
+
+            ssize_t r = job.in.read(buf.data(), buf.size());
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r == -1)
+                return failed(std::strerror(errno));
+
+            res.clear();
+            if (r == 0)
+                gz.finish(res);
+            else
+                gz.write(buf.data(), r, res), in += r;
+
+            for (size_t done = 0; done < res.size(); )
+            {
+                ssize_t w = fd.write(res.data() + done, res.size() - done);
+                if (w == -1 && errno == EINTR)
+                    continue;
+                if (w == -1)
+                    return failed(std::strerror(errno));
+                done += w;
+                out += w;
+            }
+
+            if (r == 0)
+                break;
+        }
+
+        // on the disk before the log it replaces is removed
+        if (::fdatasync(fd.fd) == -1)
+            return failed(std::strerror(errno));
+        return {};
+    }
+};
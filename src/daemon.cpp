@@ -1,9 +1,9 @@
 
 // daemon
 #define _DEFAULT_SOURCE
-// sigaction, siginfo_t
+// sigprocmask
 #define _POSIX_C_SOURCE 200809L
-// ppoll
+// SOCK_NONBLOCK, SOCK_CLOEXEC
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
@@ -14,30 +14,36 @@
 #include "common.hpp"   // app, to_str
 #include "log.hpp"      // *log*
 #include "fd.hpp"       // fd
+#include "loop.hpp"     // loop_t
+#include "registry.hpp" // registry_t
+#include "zygote.hpp"   // zygote_t, spawn_zygote
 
 // deps
 #include "deps/json.hpp"
 
 // posix
-#include <fcntl.h>      // fcntl
-#include <unistd.h>     // fcntl, daemon
-#include <sys/socket.h> // bind, socket, connect, listen, accept
-#include <sys/types.h>  // bind, socket, connect, listen, accept
+#include <unistd.h>     // daemon
+#include <sys/socket.h> // bind, socket, listen
+#include <sys/types.h>  // bind, socket, listen
 #include <sys/un.h>     // sockaddr_un
-#include <poll.h>       // ppoll
-#include <signal.h>     // ppoll, sig_atomic_t, sigaction, sigemptyset,
-                        //        sigaddset, sigprocmask, sigsuspend, SIG*
+#include <sys/epoll.h>  // EPOLL*
+#include <sys/signalfd.h> // signalfd, signalfd_siginfo
+#include <sys/resource.h> // getrlimit, setrlimit, RLIMIT_NOFILE
+#include <signal.h>     // sigemptyset, sigaddset, sigprocmask, SIG*
 
 // c
 #include <cstdio>       // printf
-#include <cstring>      // strncpy, memset
+#include <cstdlib>      // atoi
+#include <cstring>      // strncpy
 #include <cerrno>       // errno
+#include <cstdint>      // int64_t, INT64_MAX
 
 // cpp
 #include <fstream>      // ifstream
 #include <map>          // map
 #include <filesystem>   // fs::*
 #include <array>        // array
+#include <optional>     // optional
 
 
 using json = nlohmann::json;
@@ -46,73 +52,185 @@ using json = nlohmann::json;
 namespace fs = std::filesystem;
 
 
-struct reactions_t
-{
-    sig_atomic_t terminate{ 0 };
-    sig_atomic_t child_dead{ 0 };
-
-} static volatile reactions;
-
-
 static const std::array react_sigs =
 {
-    SIGCHLD,    // important, our need to reap child
     SIGTERM,    // term
     SIGINT,     // term
     SIGALRM,    // term
     SIGABRT,    // core
     SIGQUIT,    // core
+    SIGHUP,     // reload
 };
 
 
-void handler(int sig,
-             [[maybe_unused]] siginfo_t* info,
-             [[maybe_unused]] void* ucontext)
+fd_t setup_react_signals()
 {
-    switch (sig)
-    {
-        case SIGCHLD: reactions.child_dead = 1; break;
+    sigset_t mask;
+    sigemptyset(&mask);
+
+    for (size_t i = 0; i < react_sigs.size(); i++)
+        sigaddset(&mask, react_sigs[i]);
+
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1)
+        throw std::runtime_error("sigprocmask");
 
-        // term
-        case SIGTERM: [[fallthrough]];
-        case SIGINT:  [[fallthrough]];
-        case SIGALRM: reactions.terminate = 1; break;
+    fd_t sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (!sfd)
+        throw std::runtime_error("signalfd");
+
+    return sfd;
+}
+
+
+// Each running app takes fds of the daemon: the read ends of its two pipes,
+// its two logs and its pidfd. The soft limit, 1024 by default, is no more
+// than a few hundred apps, the hard one is what the admin allows.
+void raise_fd_limit()
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1)
+        return log_errno(errno);
+    if (lim.rlim_cur == lim.rlim_max)
+        return;
+
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+        log_errno(errno);
+}
 
-        // core
-        case SIGABRT: [[fallthrough]];
-        case SIGQUIT: reactions.terminate = 1; break;
 
-        default: break;
+void on_signals(server_t& server, fd_t& sfd)
+{
+    // children are not handled here, each one's exit is delivered
+    // through its own pidfd
+    struct signalfd_siginfo info;
+    while (sfd.read(reinterpret_cast<char*>(&info), sizeof(info))
+            == sizeof(info))
+    {
+        switch (info.ssi_signo)
+        {
+            // term
+            case SIGTERM: [[fallthrough]];
+            case SIGINT:  [[fallthrough]];
+            case SIGALRM: server.loop.stop(); break;
+
+            // core
+            case SIGABRT: [[fallthrough]];
+            case SIGQUIT: server.loop.stop(); break;
+
+            // reload
+            case SIGHUP:
+                if (auto err = server.reload())
+                    log_err("reload: ", *err);
+                break;
+
+            default: break;
+        }
     }
 }
 
 
-void setup_react_signals()
+void handle(server_t& server, const reply_t& to, const message& msg)
 {
-    for (size_t i = 0; i < react_sigs.size(); i++)
+    auto it = COMMANDS.find(msg.arg);
+    if (it == COMMANDS.end())
+    {
+        log_err("invalid cmd '", msg.arg, "'");
+        return server.finish(to, message{ "invalid cmd", msg.arg.c_str() });
+    }
+
+    // a command which fails answers its request, the daemon serves on
+    auto& cmd = it->second;
+    try
     {
-        struct sigaction act;
-        std::memset(&act, 0, sizeof(act));
-        act.sa_sigaction = handler;
-        act.sa_flags = SA_SIGINFO,
-        sigaction(react_sigs[i], &act, nullptr);
+        if (auto resp = cmd.func(msg, server, to))
+            server.finish(to, *resp);
+    }
+    catch (const std::exception& e)
+    {
+        log_err(msg.arg, ": ", e.what());
+        if (server.waiting(to))
+            server.finish(to, message{ "error", e.what() });
     }
 }
 
 
-std::map<std::string, app_t> parse(const fs::path& path)
+registry_t parse(const fs::path& path)
 {
+    static constexpr const char* Key = "=,! \t";
+    static constexpr const char* Value = ",";
+
     auto data = json{};
     auto in = std::ifstream(path);
     in >> data;
     in.close();
 
-    auto result = std::map<std::string, app_t>{};
+    auto result = registry_t{};
+    result.reserve(data.size());
+
+    // the characters of selectors cannot be matched in labels, and the
+    // key ‹name› selects by the name of the app
+    auto check = [](const std::string& app, const std::string& str,
+                    const char* special)
+    {
+        if (str.find_first_of(special) != std::string::npos
+                || (special == Key && (str.empty() || str == "name")))
+            throw std::runtime_error("invalid label '" + str + "' of '"
+                                     + app + "'");
+        return str;
+    };
 
     for (auto& [key, value] : data.items())
     {
-        result.emplace(key, app_t{ value["dir"], argv_t{ value["start"]  },
-                                                 argv_t{ value["update"] } });
+        auto app = app_t{ value["dir"], argv_t{ value["start"]  },
+                                        argv_t{ value["update"] } };
+
+        // kept, items() does not extend the lifetime of a temporary
+        auto labels = value.value("labels", json::object());
+        auto tags = value.value("tags", json::array());
+        auto inherit = value.value("inherit", json::array());
+        app.timestamps = value.value("timestamps", false);
+        auto rotate = value.value("rotate", json::object());
+
+        for (auto& [k, v] : labels.items())
+            app.labels.emplace_back(check(key, k, Key),
+                                    check(key, v.get<std::string>(), Value));
+        for (auto& tag : tags)
+            app.labels.emplace_back(check(key, tag.get<std::string>(), Key),
+                                    "");
+
+        // 0, 1 and 2 are those of the app already
+        for (auto& fd : inherit)
+        {
+            if (!fd.is_number_integer() || fd.get<int>() < 3)
+                throw std::runtime_error("invalid fd '" + fd.dump()
+                                         + "' of '" + key + "'");
+            app.inherit.push_back(fd.get<int>());
+        }
+
+        auto limit = [&](const char* field, std::int64_t max)
+        {
+            auto val = rotate.value(field, json{});
+            if (val.is_null())
+                return std::int64_t(-1);
+            if (!val.is_number_integer() || val.get<std::int64_t>() < 0
+                    || val.get<std::int64_t>() > max)
+                throw std::runtime_error("invalid rotate."
+                                         + std::string{ field } + " of '"
+                                         + key + "'");
+            return val.get<std::int64_t>();
+        };
+
+        if (auto size = limit("max_size", INT64_MAX); size != -1)
+            app.rotate.max_size = size;
+        if (auto age = limit("max_age", INT64_MAX); age != -1)
+            app.rotate.max_age = age;
+        if (auto keep = limit("keep", 1000); keep != -1)
+            app.rotate.keep = unsigned(keep);
+        if (auto level = limit("compress", 9); level != -1)
+            app.rotate.compress = int(level);
+
+        result.add(key, std::move(app));
     }
     return result;
 }
@@ -120,7 +238,9 @@ std::map<std::string, app_t> parse(const fs::path& path)
 
 void print_usage(const char* argv0)
 {
-    std::printf("usage: %s [--no-daemon | -nod]]\n", argv0);
+    std::printf("usage: %s [--no-daemon | -nod] [--max-clients N]"
+                " [--compress-threads N] [--compress-queue N]"
+                " [--spawn-helper]\n", argv0);
 }
 
 
@@ -131,11 +251,26 @@ int run(int argc, char** argv)
     using namespace std::literals;
 
     bool deamonize = true;
-    if (argc > 1)
+    size_t max_clients = MAX_CLIENTS;
+    unsigned compress_threads = COMPRESS_THREADS;
+    size_t compress_queue = COMPRESS_QUEUE;
+    bool spawn_helper = false;
+    for (int i = 1; i < argc; i++)
     {
-        if (argv[1] == "--no-daemon"sv || argv[1] == "-nod"sv)
+        if (argv[i] == "--no-daemon"sv || argv[i] == "-nod"sv)
             deamonize = false;
-        else if (argv[1] == "--help"sv)
+        else if (argv[i] == "--max-clients"sv && i + 1 < argc
+                    && std::atoi(argv[i + 1]) > 0)
+            max_clients = std::atoi(argv[++i]);
+        else if (argv[i] == "--compress-threads"sv && i + 1 < argc
+                    && std::atoi(argv[i + 1]) >= 0)
+            compress_threads = std::atoi(argv[++i]);
+        else if (argv[i] == "--compress-queue"sv && i + 1 < argc
+                    && std::atoi(argv[i + 1]) > 0)
+            compress_queue = std::atoi(argv[++i]);
+        else if (argv[i] == "--spawn-helper"sv)
+            spawn_helper = true;
+        else if (argv[i] == "--help"sv)
             return print_usage(argv[0]), 0;
         else
             return print_usage(argv[0]), 1;
@@ -148,23 +283,47 @@ int run(int argc, char** argv)
         log_output(syslog_tag{});
     }
 
-    setup_react_signals();
+    // if asked to, apps are spawned by a helper forked while the daemon is
+    // still small, and in the daemon only if that fails; a round trip to
+    // it costs more than a clone in the daemon, which copies nothing
+    auto zygote = std::optional<zygote_t>{};
+    try
+    {
+        if (spawn_helper)
+        {
+            zygote.emplace(zygote_t::start());
+            ZYGOTE = &*zygote;
+            spawner = spawn_zygote;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        log_err(e.what());
+    }
 
-    sigset_t mask_set,
-             mask_old;
-    sigemptyset(&mask_set);
+    // after the helper's fork, apps keep the limit srvd was started with
+    raise_fd_limit();
 
-    for (size_t i = 0; i < react_sigs.size(); i++)
-        sigaddset(&mask_set, react_sigs[i]);
+    fd_t sfd = setup_react_signals();
 
-    if (sigprocmask(SIG_BLOCK, &mask_set, &mask_old) == -1)
-        return log_errno(errno), 1;
+    // a client may disconnect before its reply is written
+    signal(SIGPIPE, SIG_IGN);
 
     server_t server;
-    server.apps = parse(CONF_PATH);
+    server.max_clients = max_clients;
+    server.handle = handle;
+    server.config = []() { return parse(CONF_PATH); };
+
+    // readable by ‹srvctl list› and monitors without asking the daemon,
+    // it outlives the daemon as the last known state
+    server.status.path = STAT_PATH;
 
-    server.sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (!server.sock)
+    // after daemon() and the helper's fork, neither of which keeps threads
+    server.logs.start(server.loop, compress_threads, compress_queue);
+    server.load(parse(CONF_PATH));
+
+    fd_t sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (!sock)
         return log_errno(errno), 1;
 
     struct sockaddr_un addr;
@@ -173,66 +332,26 @@ int run(int argc, char** argv)
 
     fs::remove(SOCK_PATH);
 
-    if (bind(server.sock.fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+    if (bind(sock.fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
         return log_errno(errno), 1;
 
-    if (listen(server.sock.fd, MAX_CLIENTS) == -1)
+    // connections over the limit wait here, until a slot is free
+    if (listen(sock.fd, SOMAXCONN) == -1)
         return log_errno(errno), 1;
 
     // // TODO: perhaps:
     // prctl(PR_SET_CHILD_SUBREAPER, ...);
 
-    struct pollfd fds = { server.sock.fd, POLLIN | POLLOUT, 0 };
-
-    struct timespec delay;
-    delay.tv_sec = 3;
-    delay.tv_nsec = 0;
-
-    message msg;
-
-    fcntl(server.sock.fd, F_SETFL, O_NONBLOCK);
-
-    while (true)
+    server.loop.add(sfd.fd, EPOLLIN, [&](uint32_t)
     {
-        if (ppoll(&fds, 1, &delay, &mask_old) == 0)
-            continue;
-
-        if (reactions.terminate)
-            return 0;
-
-        if (reactions.child_dead == 1)
-        {
-            reactions.child_dead = 0;
-            server.reap_zombies();
-        }
-
-        fd_t client = accept4(server.sock.fd, nullptr, nullptr, SOCK_CLOEXEC);
-        if (!client)
-        {
-            int err = errno;
-            if (err == EAGAIN || err == EWOULDBLOCK)
-                continue;
+        on_signals(server, sfd);
+    });
 
-            log_errno(errno);
-            continue;  // do not exit in case a client connection fails
-        }
+    server.listen(std::move(sock));
 
-        msg.recv(client);
-
-        auto it = COMMANDS.find(msg.arg);
-        if (it != COMMANDS.end())
-        {
-            auto& cmd = it->second;
-            auto resp = cmd.func(msg, server);
-            resp.send(client);
-        }
-        else
-        {
-            auto resp = message{ "invalid cmd", msg.arg };
-            resp.send(client);
-            log_err("invalid cmd '", msg.arg, "'");
-        }
-    }
+    // blocks until a terminating signal arrives, there are no timeouts,
+    // so an idle daemon is never woken up
+    server.loop.run();
 
     return 0;
 }
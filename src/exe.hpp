@@ -0,0 +1,275 @@
+#pragma once
+
+// headers
+#include "registry.hpp" // registry_t, app_id
+#include "proc.hpp"     // exe_t
+#include "log.hpp"      // *log*
+#include "fd.hpp"       // fd_t
+
+// posix
+#include <sys/inotify.h> // inotify_*
+#include <sys/stat.h>   // stat, fstat
+#include <fcntl.h>      // open, O_PATH
+#include <unistd.h>     // access, confstr
+#include <limits.h>     // NAME_MAX
+
+// c
+#include <cerrno>       // errno
+#include <cstdlib>      // getenv, realpath, free
+
+// cpp
+#include <map>          // map
+#include <optional>     // optional
+#include <set>          // set
+#include <string>       // string
+#include <string_view>  // string_view
+#include <utility>      // pair
+#include <vector>       // vector
+
+
+/*
+ * The executables of the apps, found as execvp would find them, once, so
+ * that a start is an execveat, without searching PATH again. A file is
+ * opened as an O_PATH descriptor by the first start which runs it, and kept
+ * for every app which runs the same file, by its inode. A start the daemon
+ * has no descriptor for, when it is out of them, execs the path found.
+ *
+ * The directories of PATH and those the executables were found in are
+ * watched by inotify. A change of a name in any of them forgets the
+ * executables of that name, they are found again by their next start.
+ * A relative directory of PATH is the child's, taken from the directory
+ * of each app, as the child searches it after its chdir.
+ */
+struct exe_cache_t
+{
+    using file_id = std::pair<dev_t, ino_t>;
+
+    struct entry_t
+    {
+        std::string path{};         // empty if not found, execvp decides then
+        file_id file{};
+        bool found = false;         // looked for since the last change
+    };
+
+    struct file_t
+    {
+        fd_t fd{ -1 };              // opened once needed
+        size_t users = 0;           // entries found to be the file
+    };
+
+    fd_t notify{ -1 };
+    std::vector<entry_t> entries{};                 // by app id
+    std::map<file_id, file_t> files{};
+    std::vector<std::string> path_dirs{};
+    std::map<std::string, int, std::less<>> watched{};  // directory, watch
+    std::map<std::string, std::set<app_id>, std::less<>> by_name{};
+
+    // Starts over with the apps of a new registry.
+    void load(const registry_t& apps)
+    {
+        if (notify)
+            notify.close();
+        notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (!notify)
+            log_errno(errno);
+
+        entries.clear();
+        entries.resize(apps.size());
+        files.clear();
+        watched.clear();
+        by_name.clear();
+
+        // execvp searches the default path if there is no PATH
+        path_dirs.clear();
+        auto path = std::string{};
+        if (const char* env = std::getenv("PATH"))
+            path = env;
+        else
+        {
+            path.resize(::confstr(_CS_PATH, nullptr, 0));
+            ::confstr(_CS_PATH, path.data(), path.size());
+            path.resize(path.size() - 1);
+        }
+
+        for (size_t pos = 0; pos <= path.size(); )
+        {
+            size_t end = std::min(path.find(':', pos), path.size());
+            // an empty entry is the current directory, a relative one is
+            // watched per app, from its directory
+            auto dir = path.substr(pos, end - pos);
+            path_dirs.push_back(dir.empty() ? "." : dir);
+            if (path_dirs.back()[0] == '/')
+                watch(path_dirs.back());
+            pos = end + 1;
+        }
+
+        for (app_id id = 0; id < apps.size(); ++id)
+            find(apps, id);
+    }
+
+    exe_t get(const registry_t& apps, app_id id)
+    {
+        if (!entries[id].found)
+            find(apps, id);
+
+        const auto& e = entries[id];
+        if (e.path.empty())
+            return exe_t{};
+
+        auto& f = files.at(e.file);
+        if (!f.fd)
+            f.fd = open(e.path, e.file);
+        return exe_t{ f.fd.fd, e.path.c_str() };
+    }
+
+    // Reads the changes, to be called once ‹notify› is readable.
+    void on_events()
+    {
+        alignas(struct inotify_event) char buf[16 * (sizeof(inotify_event)
+                                                     + NAME_MAX + 1)];
+        ssize_t r;
+        while ((r = notify.read(buf, sizeof(buf))) > 0)
+        {
+            for (char* p = buf; p < buf + r; )
+            {
+                auto* ev = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+
+                // too many to tell which, or a directory is gone
+                if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED))
+                {
+                    for (app_id id = 0; id < entries.size(); ++id)
+                        forget(id);
+                    continue;
+                }
+
+                auto it = ev->len != 0 ? by_name.find(ev->name)
+                                       : by_name.end();
+                if (it != by_name.end())
+                    for (app_id id : it->second)
+                        forget(id);
+            }
+        }
+    }
+
+private:
+    void forget(app_id id)
+    {
+        auto& e = entries[id];
+        if (!e.path.empty())
+        {
+            auto it = files.find(e.file);
+            if (--it->second.users == 0)
+                files.erase(it);
+        }
+        e = entry_t{};
+    }
+
+    static std::string_view base(std::string_view path)
+    {
+        size_t slash = path.rfind('/');
+        return slash == std::string_view::npos ? path
+                                               : path.substr(slash + 1);
+    }
+
+    static std::string dir(std::string_view path)
+    {
+        size_t slash = path.rfind('/');
+        if (slash == std::string_view::npos)
+            return ".";
+        return slash == 0 ? "/" : std::string{ path.substr(0, slash) };
+    }
+
+    void watch(const std::string& dir)
+    {
+        if (!notify || watched.count(dir) != 0)
+            return;
+
+        int wd = ::inotify_add_watch(notify.fd, dir.c_str(),
+                                     IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                                     | IN_MOVED_TO | IN_ATTRIB
+                                     | IN_CLOSE_WRITE | IN_ONLYDIR);
+        watched.emplace(dir, wd);
+    }
+
+    void depend(app_id id, std::string_view path)
+    {
+        by_name[std::string{ base(path) }].insert(id);
+        if (path.find('/') != std::string_view::npos)
+            watch(dir(path));
+    }
+
+    // The file at ‹path›, if it can be executed.
+    static std::optional<file_id> check(const std::string& path)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode)
+                || ::access(path.c_str(), X_OK) == -1)
+            return {};
+        return file_id{ st.st_dev, st.st_ino };
+    }
+
+    // Opens the file at ‹path›, unless it is another one by now, which is
+    // yet to be reported, or there is no descriptor for it (EMFILE).
+    static fd_t open(const std::string& path, file_id file)
+    {
+        fd_t fd = ::open(path.c_str(), O_PATH | O_CLOEXEC);
+        struct stat st;
+        if (!fd || ::fstat(fd.fd, &st) == -1
+                || file_id{ st.st_dev, st.st_ino } != file)
+            return fd_t{ -1 };
+        return fd;
+    }
+
+    void find(const registry_t& apps, app_id id)
+    {
+        const auto& app = apps.apps[id];
+        forget(id);
+        auto& e = entries[id];
+        e.found = true;
+
+        // the first argument, up to its '\0'
+        const char* name = app.start.data.c_str();
+        depend(id, name);
+
+        auto candidates = std::vector<std::string>{};
+        if (std::string_view{ name }.find('/') == std::string_view::npos)
+            for (const auto& d : path_dirs)
+            {
+                // searched by the child, from the directory of the app
+                if (d[0] == '/')
+                {
+                    candidates.push_back(d + "/" + name);
+                    continue;
+                }
+                auto at = app.dir + "/" + d;
+                watch(at);
+                candidates.push_back(at + "/" + name);
+            }
+        else if (name[0] == '/')
+            candidates.push_back(name);
+        else    // as the child finds it, from the directory of the app
+            candidates.push_back(app.dir + "/" + name);
+
+        for (auto& file : candidates)
+        {
+            auto found = check(file);
+            if (!found)
+                continue;
+
+            e.path = std::move(file);
+            e.file = *found;
+            ++files[e.file].users;
+            depend(id, e.path);
+
+            // a symlink, such as of an interpreter, is replaced through
+            // its target
+            if (char* real = ::realpath(e.path.c_str(), nullptr))
+            {
+                depend(id, real);
+                std::free(real);
+            }
+            return;
+        }
+    }
+};
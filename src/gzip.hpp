@@ -0,0 +1,613 @@
+#pragma once
+
+// c
+#include <cstdint>      // uint*_t, int64_t
+#include <cstddef>      // size_t
+
+// cpp
+#include <algorithm>    // min, max, clamp, count_if
+#include <functional>   // greater
+#include <queue>        // priority_queue
+#include <string>       // string
+#include <utility>      // pair
+#include <vector>       // vector
+
+
+/*
+ * A gzip (RFC 1952) writer with a DEFLATE (RFC 1951) encoder of its own, so
+ * that srvd needs no zlib.
+ *
+ * Matches are found by hash chains over the last 32 KiB, followed as far as
+ * the level asks, from 4 up with a lazy look one byte ahead, as zlib does.
+ * Either weighs a longer match against its distance: in text such as logs,
+ * a match a line back recurs with one cheap code, while a longer one from
+ * further back is a distance of its own each time. Taken for any longer
+ * match, as by zlib, more looking makes logs larger. Each block gets the
+ * Huffman codes of its own symbols, or is stored if that is smaller. Level
+ * 0 stores everything.
+ */
+struct gzip_t
+{
+    explicit gzip_t(int level = 6)
+        : level(std::clamp(level, 0, 9))
+        , head(HashSize, -1)
+        , prev(Window, -1)
+    {
+        static constexpr params_t by_level[10] =
+        {
+            { 0, 0, false },
+            { 4, 8, false }, { 6, 16, false }, { 8, 32, false },
+            { 8, 16, true }, { 16, 32, true }, { 32, 128, true },
+            { 64, 128, true }, { 256, 258, true }, { 1024, 258, true },
+        };
+        params = by_level[this->level];
+    }
+
+    // Appends what is compressed of ‹data› to ‹out›, the end of it is held
+    // back, to be matched with what follows.
+    void write(const char* data, size_t len, std::string& out)
+    {
+        if (!started)
+        {
+            // magic, deflate, no flags, no mtime, extra flags, unix
+            const unsigned char header[10] =
+            {
+                0x1f, 0x8b, 8, 0, 0, 0, 0, 0,
+                std::uint8_t(level == 9 ? 2 : level == 1 ? 4 : 0), 3,
+            };
+            out.append(reinterpret_cast<const char*>(header), sizeof(header));
+            started = true;
+        }
+
+        if (len == 0)
+            return;
+        crc = crc32(crc, data, len);
+        size += len;
+        buf.append(data, len);
+        encode(false, out);
+    }
+
+    // Appends the rest, and the trailer.
+    void finish(std::string& out)
+    {
+        write(nullptr, 0, out);
+        encode(true, out);
+
+        if (nbits != 0)
+            put(0, 8 - nbits, out);
+        for (std::uint32_t word : { crc, std::uint32_t(size) })
+            for (int i = 0; i < 4; ++i)
+                out.push_back(char(word >> (8 * i)));
+    }
+
+private:
+    static constexpr int Window = 1 << 15;
+    static constexpr int MinMatch = 3;
+    static constexpr int MaxMatch = 258;
+    static constexpr int HashBits = 15;
+    static constexpr int HashSize = 1 << HashBits;
+    static constexpr size_t MaxSymbols = 1 << 15;
+    static constexpr std::uint64_t MaxBlock = 1 << 20;     // of input
+    static constexpr size_t Keep = 1 << 20;     // dropped from buf at once
+
+    struct params_t
+    {
+        int chain;      // candidates looked at
+        int nice;       // a match long enough to stop looking
+        bool lazy;
+    };
+
+    struct match_t
+    {
+        int len = 0;
+        int dist = 0;
+    };
+
+    struct sym_t
+    {
+        std::uint16_t len;  // the literal if ‹dist› is 0
+        std::uint16_t dist;
+    };
+
+    // the symbols of lengths and distances, from 257 and 0
+    struct tables_t
+    {
+        std::uint8_t len_code[MaxMatch + 1];
+        std::uint8_t dist_code[512];    // by dist - 1, then (dist - 1) >> 7
+
+        static constexpr std::uint16_t len_base[29] =
+        {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43,
+            51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+        };
+        static constexpr std::uint8_t len_extra[29] =
+        {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4,
+            4, 4, 5, 5, 5, 5, 0,
+        };
+        static constexpr std::uint16_t dist_base[30] =
+        {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257,
+            385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+            16385, 24577,
+        };
+        static constexpr std::uint8_t dist_extra[30] =
+        {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9,
+            10, 10, 11, 11, 12, 12, 13, 13,
+        };
+
+        tables_t()
+        {
+            for (int code = 0; code < 29; ++code)
+                for (int len = len_base[code];
+                     len < len_base[code] + (1 << len_extra[code])
+                        && len <= MaxMatch; ++len)
+                    len_code[len] = code;
+            len_code[MaxMatch] = 28;
+
+            for (int code = 0; code < 30; ++code)
+                for (int d = dist_base[code] - 1;
+                     d < dist_base[code] - 1 + (1 << dist_extra[code]); ++d)
+                {
+                    if (d < 256)
+                        dist_code[d] = code;
+                    else
+                        dist_code[256 + (d >> 7)] = code;
+                }
+        }
+
+        int dist(int d) const
+        {
+            return --d < 256 ? dist_code[d] : dist_code[256 + (d >> 7)];
+        }
+    };
+
+    static const tables_t& tables()
+    {
+        static const auto t = tables_t{};
+        return t;
+    }
+
+    int level;
+    params_t params{};
+    bool started = false;
+    std::uint32_t crc = 0;
+    std::uint64_t size = 0;
+
+    std::string buf{};                  // of the input, from ‹base›
+    std::uint64_t base = 0;
+    std::uint64_t pos = 0;              // the next to encode
+    std::uint64_t hashed = 0;           // all before are in the chains
+    std::uint64_t block = 0;            // where the current block starts
+    std::vector<std::int64_t> head;     // by hash, the last position
+    std::vector<std::int64_t> prev;     // by position, the one before
+    std::vector<sym_t> syms{};
+
+    std::uint64_t bits = 0;             // not yet written, ‹nbits› of them
+    int nbits = 0;
+
+    std::uint64_t end() const { return base + buf.size(); }
+
+    const std::uint8_t* at(std::uint64_t p) const
+    {
+        return reinterpret_cast<const std::uint8_t*>(buf.data()) + (p - base);
+    }
+
+    std::uint32_t hash(std::uint64_t p) const
+    {
+        const auto* s = at(p);
+        std::uint32_t v = s[0] | (s[1] << 8) | (s[2] << 16);
+        return (v * 2654435761u) >> (32 - HashBits);
+    }
+
+    void insert_upto(std::uint64_t p)
+    {
+        for (; hashed < p; ++hashed)
+        {
+            if (hashed + MinMatch > end())
+                continue;
+            auto h = hash(hashed);
+            prev[hashed & (Window - 1)] = head[h];
+            head[h] = std::int64_t(hashed);
+        }
+    }
+
+    // The longest match of what is at ‹p› within the window, all before
+    // ‹p› being in the chains.
+    match_t longest(std::uint64_t p) const
+    {
+        const auto& t = tables();
+        auto best = match_t{ MinMatch - 1, 0 };
+        if (p + MinMatch > end())
+            return {};
+
+        int max = int(std::min<std::uint64_t>(MaxMatch, end() - p));
+        const auto* s = at(p);
+        auto cand = head[hash(p)];
+
+        for (int chain = params.chain; chain > 0 && cand >= 0
+                && p - cand <= std::uint64_t(Window); --chain)
+        {
+            const auto* c = at(cand);
+            if (c[best.len] == s[best.len] && c[0] == s[0] && c[1] == s[1])
+            {
+                int len = 2;
+                while (len < max && c[len] == s[len])
+                    ++len;
+                if (len > best.len && (best.len < MinMatch
+                        || worth(len - best.len, t.dist(int(p - cand))
+                                                 - t.dist(best.dist), 1, 0)))
+                {
+                    best = match_t{ len, int(p - cand) };
+                    if (len >= params.nice || len == max)
+                        break;
+                }
+            }
+            cand = prev[cand & (Window - 1)];
+        }
+
+        return best.len >= MinMatch ? best : match_t{};
+    }
+
+    // Whether a match ‹more› bytes longer is worth its distance ‹codes›
+    // further, in eighths of a byte for each code, plus a ‹toll›.
+    static bool worth(int more, int codes, int per_code, int toll)
+    {
+        return more * 8 > codes * per_code + toll;
+    }
+
+    void literal(std::uint64_t p)
+    {
+        syms.push_back(sym_t{ *at(p), 0 });
+    }
+
+    void encode(bool last, std::string& out)
+    {
+        // a match may need the next MaxMatch bytes
+        std::uint64_t limit = last ? end()
+                            : end() > MaxMatch ? end() - MaxMatch : 0;
+
+        while (pos < limit)
+        {
+            if (level == 0)
+            {
+                pos = std::min(limit, block + MaxBlock);
+                if (pos - block >= MaxBlock)
+                    flush(false, out);
+                continue;
+            }
+
+            insert_upto(pos);
+            auto m = longest(pos);
+
+            if (m.len != 0 && params.lazy && m.len < params.nice
+                    && pos + 1 < limit)
+            {
+                // the literal it takes is paid for too
+                insert_upto(pos + 1);
+                auto next = longest(pos + 1);
+                const auto& t = tables();
+                if (next.len > m.len
+                        && worth(next.len - m.len,
+                                 t.dist(next.dist) - t.dist(m.dist), 6, 16))
+                {
+                    literal(pos++);
+                    m = next;
+                }
+            }
+
+            if (m.len == 0)
+                literal(pos++);
+            else
+            {
+                syms.push_back(sym_t{ std::uint16_t(m.len),
+                                      std::uint16_t(m.dist) });
+                pos += m.len;
+            }
+
+            if (syms.size() >= MaxSymbols || pos - block >= MaxBlock)
+                flush(false, out);
+        }
+
+        if (last)
+            flush(true, out);
+
+        // the window, and the current block, in case it is stored
+        auto keep = std::min(block, pos > Window ? pos - Window : 0);
+        if (keep > base + Keep)
+        {
+            buf.erase(0, keep - base);
+            base = keep;
+        }
+    }
+
+    void put(std::uint64_t value, int count, std::string& out)
+    {
+        bits |= value << nbits;
+        nbits += count;
+        while (nbits >= 8)
+        {
+            out.push_back(char(bits & 0xff));
+            bits >>= 8;
+            nbits -= 8;
+        }
+    }
+
+    // Lengths of a Huffman code for ‹freq›, none over ‹limit›; with at least
+    // two codes, so that the code is complete.
+    static std::vector<std::uint8_t> lengths(std::vector<std::uint32_t> freq,
+                                             int limit)
+    {
+        size_t n = freq.size();
+        size_t used = std::count_if(freq.begin(), freq.end(),
+                                    [](auto f) { return f != 0; });
+        for (size_t i = 0; used < 2 && i < n; ++i)
+            if (freq[i] == 0)
+                freq[i] = 1, ++used;
+
+        auto len = std::vector<std::uint8_t>(n);
+        while (true)
+        {
+            // leaves are 0 .. n-1, inner nodes follow, the root last
+            using node_t = std::pair<std::uint64_t, size_t>;
+            auto heap = std::priority_queue<node_t, std::vector<node_t>,
+                                            std::greater<node_t>>{};
+            auto parent = std::vector<size_t>(n, 0);
+            for (size_t i = 0; i < n; ++i)
+                if (freq[i] != 0)
+                    heap.emplace(freq[i], i);
+
+            while (heap.size() > 1)
+            {
+                auto [wa, a] = heap.top();
+                heap.pop();
+                auto [wb, b] = heap.top();
+                heap.pop();
+                parent.push_back(0);
+                parent[a] = parent[b] = parent.size() - 1;
+                heap.emplace(wa + wb, parent.size() - 1);
+            }
+
+            auto depth = std::vector<int>(parent.size(), 0);
+            for (size_t i = parent.size() - 1; i-- > n; )
+                depth[i] = depth[parent[i]] + 1;
+
+            int max = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                len[i] = freq[i] != 0 ? depth[parent[i]] + 1 : 0;
+                max = std::max<int>(max, len[i]);
+            }
+            if (max <= limit)
+                return len;
+
+            // flatter, until it fits
+            for (auto& f : freq)
+                f = f != 0 ? (f + 1) / 2 : 0;
+        }
+    }
+
+    // Canonical codes of the lengths, reversed, as they are written.
+    static std::vector<std::uint16_t> codes(
+            const std::vector<std::uint8_t>& len)
+    {
+        int count[16] = {};
+        for (auto l : len)
+            ++count[l];
+        count[0] = 0;
+
+        int next[16] = {};
+        for (int bits = 1, code = 0; bits < 16; ++bits)
+        {
+            code = (code + count[bits - 1]) << 1;
+            next[bits] = code;
+        }
+
+        auto res = std::vector<std::uint16_t>(len.size());
+        for (size_t i = 0; i < len.size(); ++i)
+        {
+            if (len[i] == 0)
+                continue;
+            int code = next[len[i]]++;
+            int rev = 0;
+            for (int b = 0; b < len[i]; ++b)
+                rev |= ((code >> b) & 1) << (len[i] - 1 - b);
+            res[i] = std::uint16_t(rev);
+        }
+        return res;
+    }
+
+    void flush(bool last, std::string& out)
+    {
+        const auto& t = tables();
+
+        auto lit_freq = std::vector<std::uint32_t>(286);
+        auto dist_freq = std::vector<std::uint32_t>(30);
+        for (auto s : syms)
+        {
+            if (s.dist == 0)
+                ++lit_freq[s.len];
+            else
+            {
+                ++lit_freq[257 + t.len_code[s.len]];
+                ++dist_freq[t.dist(s.dist)];
+            }
+        }
+        ++lit_freq[256];
+
+        auto lit_len = lengths(lit_freq, 15);
+        auto dist_len = lengths(dist_freq, 15);
+
+        size_t hlit = 286, hdist = 30;
+        while (hlit > 257 && lit_len[hlit - 1] == 0)
+            --hlit;
+        while (hdist > 1 && dist_len[hdist - 1] == 0)
+            --hdist;
+
+        // the lengths of both codes, run-length encoded by 16, 17 and 18
+        auto all = std::vector<std::uint8_t>(lit_len.begin(),
+                                             lit_len.begin() + hlit);
+        all.insert(all.end(), dist_len.begin(), dist_len.begin() + hdist);
+
+        auto runs = std::vector<std::pair<std::uint8_t, std::uint8_t>>{};
+        for (size_t i = 0; i < all.size(); )
+        {
+            size_t run = 1;
+            while (i + run < all.size() && all[i + run] == all[i])
+                ++run;
+
+            if (all[i] == 0 && run >= 11)
+                runs.emplace_back(18, run = std::min<size_t>(run, 138));
+            else if (all[i] == 0 && run >= 3)
+                runs.emplace_back(17, run);
+            else if (all[i] != 0 && run >= 4)
+            {
+                runs.emplace_back(all[i], 0);
+                runs.emplace_back(16, run = std::min<size_t>(run - 1, 6));
+                ++run;
+            }
+            else
+                runs.emplace_back(all[i], 0), run = 1;
+            i += run;
+        }
+
+        auto cl_freq = std::vector<std::uint32_t>(19);
+        for (auto [sym, extra] : runs)
+            ++cl_freq[sym];
+        auto cl_len = lengths(cl_freq, 7);
+
+        static constexpr std::uint8_t order[19] =
+        {
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+        };
+        size_t hclen = 19;
+        while (hclen > 4 && cl_len[order[hclen - 1]] == 0)
+            --hclen;
+
+        // the size of each way to write the block, in bits
+        auto extra_bits = [](std::uint8_t sym)
+        {
+            return sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0;
+        };
+        std::uint64_t dynamic = 3 + 14 + 3 * hclen + lit_len[256];
+        for (auto [sym, extra] : runs)
+            dynamic += cl_len[sym] + extra_bits(sym);
+        for (auto s : syms)
+        {
+            if (s.dist == 0)
+                dynamic += lit_len[s.len];
+            else
+            {
+                int lc = t.len_code[s.len], dc = t.dist(s.dist);
+                dynamic += lit_len[257 + lc] + t.len_extra[lc]
+                         + dist_len[dc] + t.dist_extra[dc];
+            }
+        }
+
+        std::uint64_t raw = pos - block;
+        std::uint64_t stored = (raw / 65535 + 1) * (3 + 7 + 32) + 8 * raw;
+
+        if (level == 0 || stored <= dynamic)
+            write_stored(last, out);
+        else
+            write_dynamic(last, out, lit_len, dist_len, cl_len, runs,
+                          hlit, hdist, hclen, order);
+
+        syms.clear();
+        block = pos;
+    }
+
+    void write_stored(bool last, std::string& out)
+    {
+        std::uint64_t at_ = block;
+        do
+        {
+            auto len = std::uint16_t(std::min<std::uint64_t>(pos - at_,
+                                                             65535));
+            bool final = last && at_ + len == pos;
+
+            put(final, 1, out);
+            put(0, 2, out);
+            if (nbits != 0)
+                put(0, 8 - nbits, out);
+            put(len, 16, out);
+            put(std::uint16_t(~len), 16, out);
+            out.append(reinterpret_cast<const char*>(at(at_)), len);
+            at_ += len;
+        }
+        while (at_ < pos);
+    }
+
+    void write_dynamic(bool last, std::string& out,
+                       const std::vector<std::uint8_t>& lit_len,
+                       const std::vector<std::uint8_t>& dist_len,
+                       const std::vector<std::uint8_t>& cl_len,
+                       const std::vector<std::pair<std::uint8_t,
+                                                   std::uint8_t>>& runs,
+                       size_t hlit, size_t hdist, size_t hclen,
+                       const std::uint8_t* order)
+    {
+        const auto& t = tables();
+        auto lit_code = codes(lit_len);
+        auto dist_code = codes(dist_len);
+        auto cl_code = codes(cl_len);
+
+        put(last, 1, out);
+        put(2, 2, out);
+        put(hlit - 257, 5, out);
+        put(hdist - 1, 5, out);
+        put(hclen - 4, 4, out);
+        for (size_t i = 0; i < hclen; ++i)
+            put(cl_len[order[i]], 3, out);
+
+        for (auto [sym, extra] : runs)
+        {
+            put(cl_code[sym], cl_len[sym], out);
+            if (sym == 16)
+                put(extra - 3, 2, out);
+            else if (sym == 17)
+                put(extra - 3, 3, out);
+            else if (sym == 18)
+                put(extra - 11, 7, out);
+        }
+
+        for (auto s : syms)
+        {
+            if (s.dist == 0)
+            {
+                put(lit_code[s.len], lit_len[s.len], out);
+                continue;
+            }
+
+            int lc = t.len_code[s.len], dc = t.dist(s.dist);
+            put(lit_code[257 + lc], lit_len[257 + lc], out);
+            put(s.len - t.len_base[lc], t.len_extra[lc], out);
+            put(dist_code[dc], dist_len[dc], out);
+            put(s.dist - t.dist_base[dc], t.dist_extra[dc], out);
+        }
+        put(lit_code[256], lit_len[256], out);
+    }
+
+    static std::uint32_t crc32(std::uint32_t crc, const char* data,
+                               size_t len)
+    {
+        static const auto table = []
+        {
+            auto t = std::vector<std::uint32_t>(256);
+            for (std::uint32_t i = 0; i < 256; ++i)
+            {
+                std::uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        crc = ~crc;
+        for (size_t i = 0; i < len; ++i)
+            crc = table[(crc ^ std::uint8_t(data[i])) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+};
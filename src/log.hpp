@@ -8,6 +8,7 @@
 #include <cstring>      // strerror
 
 // cpp
+#include <string>       // string
 #include <utility>      // forward, declval
 #include <type_traits>  // is_same_v, decay_t
 
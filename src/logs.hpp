@@ -0,0 +1,483 @@
+#pragma once
+
+// headers
+#include "common.hpp"   // rotate_t
+#include "compress.hpp" // compressor_t
+#include "loop.hpp"     // loop_t
+#include "log.hpp"      // *log*
+#include "fd.hpp"       // fd_t
+
+// posix
+#include <sys/epoll.h>  // EPOLL*
+#include <sys/stat.h>   // statx
+#include <sys/timerfd.h> // timerfd_*
+#include <fcntl.h>      // open, splice, fcntl, F_GETPIPE_SZ
+#include <unistd.h>     // pipe2, pwrite, read, unlink
+#include <time.h>       // clock_gettime, localtime_r, strftime
+
+// c
+#include <cerrno>       // errno
+#include <cstdint>      // uint64_t, INT64_MAX
+#include <cstdio>       // snprintf, rename
+#include <cstring>      // strerror, memchr
+#include <ctime>        // time
+
+// cpp
+#include <algorithm>    // count_if, max
+#include <exception>    // exception
+#include <functional>   // function, less
+#include <map>          // map
+#include <stdexcept>    // runtime_error
+#include <string>       // string
+#include <utility>      // move
+
+
+/*
+ * The output of the apps. An app writes into pipes of the daemon, which
+ * moves whatever comes into the log files by splice(), the data is never
+ * copied to userspace. Only output to be timestamped is read and written.
+ *
+ * A log file is open while a pipe feeds it. An app started again before
+ * the pipes of its previous run close (a process it left behind keeps them)
+ * shares the file with them. The offset of the next write is kept with the
+ * file, so that its size is known without asking.
+ *
+ * Logs are appended to, and rotated by their rotate_t once written past
+ * their size, or after their age: the file is renamed and a new one takes
+ * its place under the pipes, the apps write on as before. A timer is armed
+ * for the earliest age at which a log open is due, so that a log rotates
+ * even if nothing is written to it then; an empty one is never rotated.
+ *
+ * A log exceeds ‹max_size› by at most what a pipe holds, its size as
+ * F_GETPIPE_SZ tells (64 KiB by default), and the timestamps of that.
+ * Pipes are left at the size they get, the pages of all pipes of the user
+ * are limited together (pipe-user-pages-soft), and the kernel shrinks
+ * every new one past that.
+ *
+ * A rotated log to be compressed waits for room in the compressor's queue,
+ * oldest first, and is replaced by ‹LOG.N.gz› once it is done, under
+ * whichever N it has by then. One rotated past ‹keep› meanwhile is no
+ * longer compressed; there are at most ‹keep› waiting of each log.
+ */
+struct logs_t
+{
+    static constexpr size_t Budget = 1 << 20;   // by one wakeup of a pipe
+
+    struct file_t
+    {
+        fd_t fd{ -1 };
+        loff_t offset = 0;
+        size_t pipes = 0;
+        rotate_t rotate{};
+        std::int64_t since = 0;     // when it was created
+    };
+
+    struct pipe_t
+    {
+        fd_t fd{ -1 };              // the read end
+        std::string path;           // of its file
+        bool stamp = false;         // each line with the time
+        bool copy = false;          // read and written, not spliced
+        bool line_start = true;
+        bool failed = false;        // the file cannot be written
+        size_t size = 0;            // of the pipe, moved at once at most
+        loop_t::id_t watch = loop_t::none;
+    };
+
+    std::map<std::string, file_t, std::less<>> files{};
+    std::map<std::uint64_t, pipe_t> pipes{};
+    std::uint64_t next_pipe = 0;
+    std::function<void()> on_close{};   // a pipe, and perhaps its file, closed
+
+    struct pending_t
+    {
+        std::string path;           // of the log
+        unsigned n;                 // it is ‹path.n› now
+        unsigned keep;
+        int level;
+        std::string tmp;
+        bool queued = false;        // given to the compressor
+        bool refused = false;       // by the compressor, at least once
+    };
+
+    fd_t timer{ -1 };               // for the next log due by its age
+    std::int64_t armed = 0;         // when it fires, 0 if it does not
+
+    compressor_t compressor;
+    std::map<std::uint64_t, pending_t> compressing{};   // oldest first
+    std::uint64_t next_job = 0;
+
+    // Rotated logs not given to the compressor yet.
+    size_t waiting() const
+    {
+        return std::count_if(compressing.begin(), compressing.end(),
+                             [](const auto& p) { return !p.second.queued; });
+    }
+
+    // Runs the compressor, rotated logs are left as they are without it,
+    // and the timer of rotations by age.
+    void start(loop_t& loop, unsigned threads, size_t max_queue)
+    {
+        compressor.start(threads, max_queue);
+        loop.add(compressor.event.fd, EPOLLIN, [this](uint32_t)
+        {
+            compressed();
+        });
+
+        // the age is from the time of the file system, not a monotonic one
+        timer = ::timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (!timer)
+            return log_err("timerfd: ", std::strerror(errno),
+                           ", logs are rotated by age only as written");
+        loop.add(timer.fd, EPOLLIN, [this](uint32_t)
+        {
+            expired();
+        });
+    }
+
+    // Returns the write end of a new pipe into the file at ‹path›, for the
+    // app; the latest policy given for a file is the one it follows.
+    fd_t open(loop_t& loop, const std::string& path, bool stamp,
+              const rotate_t& rotate = {})
+    {
+        // first, a file has no entry without a pipe to close it
+        int ends[2];
+        if (::pipe2(ends, O_CLOEXEC) == -1)
+            throw std::runtime_error(std::string{ "pipe: " }
+                                     + std::strerror(errno));
+        fd_t in = ends[0];
+        fd_t out = ends[1];
+
+        auto found = files.find(path);
+        bool fresh = found == files.end();
+        if (fresh)
+        {
+            fd_t fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC,
+                             0644);
+            if (!fd)
+                throw std::runtime_error("open '" + path + "': "
+                                         + std::strerror(errno));
+
+            // the age of a log the daemon did not create is from its birth,
+            // where the file system keeps it
+            auto file = file_t{ std::move(fd) };
+            file.since = std::time(nullptr);
+            struct statx st;
+            if (::statx(file.fd.fd, "", AT_EMPTY_PATH, STATX_SIZE
+                        | STATX_BTIME, &st) == 0)
+            {
+                file.offset = st.stx_size;
+                if (st.stx_mask & STATX_BTIME)
+                    file.since = st.stx_btime.tv_sec;
+            }
+            found = files.emplace(path, std::move(file)).first;
+        }
+
+        // the app's end blocks, it does not expect EAGAIN
+        ::fcntl(in.fd, F_SETFL, O_NONBLOCK);
+        int size = ::fcntl(in.fd, F_GETPIPE_SZ);
+
+        auto key = next_pipe++;
+        auto watch = loop_t::none;
+        try
+        {
+            watch = loop.add(in.fd, EPOLLIN, [this, &loop, key](uint32_t)
+            {
+                drain(loop, key);
+            });
+        }
+        catch (const std::exception&)
+        {
+            if (fresh)
+                files.erase(found);
+            throw;
+        }
+
+        found->second.rotate = rotate;
+        if (due(found->second))
+            this->rotate(path, found->second);
+        schedule(found->second);
+
+        auto& p = pipes.emplace(key, pipe_t{ std::move(in), path, stamp,
+                                             stamp })
+                       .first->second;
+        p.size = size > 0 ? size : 64 << 10;
+        p.watch = watch;
+        ++found->second.pipes;
+        return out;
+    }
+
+private:
+    static bool due(const file_t& file)
+    {
+        const auto& rot = file.rotate;
+        return file.offset != 0
+            && ((rot.max_size != 0 && std::uint64_t(file.offset)
+                                      >= rot.max_size)
+                || (rot.max_age != 0 && std::time(nullptr) - file.since
+                                        >= rot.max_age));
+    }
+
+    // Arms the timer for the file, if it is due by its age before the
+    // timer fires. The timer may fire with nothing due, for a file rotated
+    // or closed meanwhile, then it is armed again for what is left.
+    void schedule(const file_t& file)
+    {
+        const auto& rot = file.rotate;
+        if (!timer || rot.max_age == 0 || file.offset == 0)
+            return;
+
+        std::int64_t at = rot.max_age > INT64_MAX - file.since
+                        ? INT64_MAX : file.since + rot.max_age;
+        if (armed != 0 && armed <= at)
+            return;
+
+        armed = at;
+        auto spec = itimerspec{};
+        spec.it_value.tv_sec = std::max<std::int64_t>(at, 1);
+        ::timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    // Rotates the logs due by their age, and arms the timer for the next.
+    void expired()
+    {
+        std::uint64_t ticks;
+        if (timer.read(reinterpret_cast<char*>(&ticks), sizeof(ticks)) == -1)
+            return;
+
+        armed = 0;
+        for (auto& [path, file] : files)
+            if (due(file))
+                rotate(path, file);
+        for (const auto& [path, file] : files)
+            schedule(file);
+    }
+
+    // Renames LOG.N to LOG.N+1 from the oldest, dropping LOG.keep, and LOG
+    // to LOG.1, then writes a new LOG. Keeps writing the old one if there
+    // cannot be a new one, and rotates it no more.
+    void rotate(const std::string& path, file_t& file)
+    {
+        auto old = [&path](unsigned n)
+        {
+            return path + "." + std::to_string(n);
+        };
+
+        for (unsigned n = file.rotate.keep; n > 1; --n)
+        {
+            ::rename(old(n - 1).c_str(), old(n).c_str());
+            ::rename((old(n - 1) + ".gz").c_str(), (old(n) + ".gz").c_str());
+        }
+        // one dropped is not compressed, what is done of it is dropped too
+        for (auto it = compressing.begin(); it != compressing.end(); )
+        {
+            auto& p = it->second;
+            if (p.path != path || ++p.n <= p.keep
+                    || (p.queued && !compressor.cancel(it->first)))
+                ++it;
+            else
+                it = compressing.erase(it);
+        }
+
+        if (file.rotate.keep != 0)
+            ::rename(path.c_str(), old(1).c_str());
+        else
+            ::unlink(path.c_str());
+
+        fd_t fresh = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC
+                                          | O_CLOEXEC, 0644);
+        if (!fresh)
+        {
+            log_err("log '", path, "': ", std::strerror(errno),
+                    ", not rotated any more");
+            file.rotate = rotate_t{};
+            return;
+        }
+
+        file.fd.close();
+        file.fd = std::move(fresh);
+        file.offset = 0;
+        file.since = std::time(nullptr);
+
+        if (file.rotate.compress == 0 || file.rotate.keep == 0
+                || !compressor.running())
+            return;
+
+        auto id = next_job++;
+        compressing.emplace(id, pending_t{ path, 1, file.rotate.keep,
+                                           file.rotate.compress, path
+                                           + ".tmp-" + std::to_string(id)
+                                           + ".gz" });
+        submit();
+    }
+
+    // Gives the compressor the logs waiting for it, oldest first, as long
+    // as it takes them.
+    void submit()
+    {
+        for (auto it = compressing.begin(); it != compressing.end(); )
+        {
+            auto& p = it->second;
+            if (p.queued)
+            {
+                ++it;
+                continue;
+            }
+
+            auto log = p.path + "." + std::to_string(p.n);
+            fd_t in = ::open(log.c_str(), O_RDONLY | O_CLOEXEC);
+            if (!in)
+            {
+                log_err("compress '", log, "': ", std::strerror(errno));
+                it = compressing.erase(it);
+                continue;
+            }
+
+            if (!compressor.submit(compressor_t::job_t{
+                        it->first, std::move(in), p.tmp, p.level },
+                                   p.refused))
+            {
+                p.refused = true;
+                return;
+            }
+            p.queued = true;
+            ++it;
+        }
+    }
+
+    // Puts the compressed logs in place of those they were made from,
+    // unless these are gone by now, and makes room for those waiting.
+    void compressed()
+    {
+        for (auto& done : compressor.collect())
+        {
+            auto node = compressing.extract(done.id);
+            if (node.empty())
+                continue;
+
+            const auto& p = node.mapped();
+            auto log = p.path + "." + std::to_string(p.n);
+            if (p.n > p.keep)
+                ::unlink(p.tmp.c_str());
+            else if (!done.error.empty())
+                log_err(done.error);
+            else if (::rename(p.tmp.c_str(), (log + ".gz").c_str()) == 0)
+                ::unlink(log.c_str());
+            else
+            {
+                log_err("compress '", log, "': ", std::strerror(errno));
+                ::unlink(p.tmp.c_str());
+            }
+        }
+        submit();
+    }
+
+    // Moves what the pipe holds into its file, closes the pipe once all
+    // its writers are gone.
+    void drain(loop_t& loop, std::uint64_t key)
+    {
+        auto& p = pipes.at(key);
+        auto& file = files.at(p.path);
+
+        ssize_t r = 0;
+        for (size_t moved = 0; moved < Budget; moved += r)
+        {
+            r = p.copy || p.failed ? copy(p, file)
+                                   : ::splice(p.fd.fd, nullptr, file.fd.fd,
+                                              &file.offset, p.size,
+                                              SPLICE_F_MOVE
+                                              | SPLICE_F_NONBLOCK);
+
+            // a file system which takes no splice
+            if (r == -1 && errno == EINVAL && !p.copy)
+            {
+                p.copy = true;
+                r = 0;
+                continue;
+            }
+
+            // whatever cannot be written is dropped, not left in the pipe
+            if (r == -1 && errno != EAGAIN && errno != EINTR && !p.failed)
+            {
+                log_err("log '", p.path, "': ", std::strerror(errno));
+                p.failed = true;
+                r = 0;
+                continue;
+            }
+            if (r <= 0)
+                break;
+
+            if (due(file))
+                rotate(p.path, file);
+        }
+
+        // the first write makes the file due some time
+        schedule(file);
+
+        if (r != 0)
+            return;
+
+        loop.del(p.watch);
+        if (--file.pipes == 0)
+            files.erase(p.path);
+        pipes.erase(key);
+
+        if (on_close)
+            on_close();
+    }
+
+    // Reads a chunk and writes it, with the time at the start of each line
+    // if the pipe is stamped, or drops it if the file failed. Returns what
+    // was read, 0 at the end, -1 with errno.
+    static ssize_t copy(pipe_t& p, file_t& file)
+    {
+        static char buf[64 << 10];
+        static auto out = std::string{};
+
+        ssize_t r = ::read(p.fd.fd, buf, sizeof(buf));
+        if (r <= 0 || p.failed)
+            return r;
+
+        char stamp[32] = "";
+        size_t stamp_len = 0;
+        if (p.stamp)
+        {
+            struct timespec now;
+            struct tm tm;
+            ::clock_gettime(CLOCK_REALTIME, &now);
+            ::localtime_r(&now.tv_sec, &tm);
+            stamp_len = ::strftime(stamp, sizeof(stamp), "%FT%T", &tm);
+            stamp_len += std::snprintf(stamp + stamp_len,
+                                       sizeof(stamp) - stamp_len, ".%03ld ",
+                                       now.tv_nsec / 1000000);
+        }
+
+        // a line split by the end of the chunk is continued by the next
+        out.clear();
+        for (ssize_t i = 0; i < r; )
+        {
+            if (p.line_start)
+                out.append(stamp, stamp_len);
+
+            const char* nl = static_cast<const char*>(
+                    std::memchr(buf + i, '\n', r - i));
+            ssize_t end = nl ? nl - buf + 1 : r;
+            out.append(buf + i, end - i);
+            p.line_start = nl != nullptr;
+            i = end;
+        }
+
+        for (size_t done = 0; done < out.size(); )
+        {
+            ssize_t w = ::pwrite(file.fd.fd, out.data() + done,
+                                 out.size() - done, file.offset);
+            if (w == -1 && errno == EINTR)
+                continue;
+            if (w == -1)
+                return -1;
+            done += w;
+            file.offset += w;
+        }
+        return r;
+    }
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+// headers
+#include "fd.hpp"           // fd_t
+#include "log.hpp"          // log_err
+
+// posix
+#include <sys/epoll.h>      // epoll_*
+
+// c
+#include <cerrno>           // errno
+#include <cstdint>          // uint32_t, uint64_t
+
+// cpp
+#include <array>            // array
+#include <exception>        // exception
+#include <functional>       // function
+#include <map>              // map
+#include <stdexcept>        // runtime_error
+#include <utility>          // move
+#include <vector>           // vector
+
+
+/*
+ * Readiness reactor built on epoll.
+ *
+ * Every source (listening socket, signalfd, client sockets, child fds, ...)
+ * is registered with a handler, which receives the ready epoll events.
+ * Sources are identified by an id rather than by their descriptor, so that
+ * a stale event for an fd removed (and possibly reused) earlier in the same
+ * batch is never delivered to the wrong handler.
+ */
+struct loop_t
+{
+    using id_t = std::uint64_t;
+    using handler_t = std::function<void(std::uint32_t)>;
+
+    static constexpr id_t none = 0;     // never assigned to a source
+
+    struct source_t
+    {
+        int fd;
+        handler_t handler;
+        bool dead = false;
+    };
+
+    fd_t epoll{ ::epoll_create1(EPOLL_CLOEXEC) };
+    std::map<id_t, source_t> sources;
+    std::vector<id_t> dead;
+    id_t next_id = 1;
+    bool running = false;
+
+    loop_t()
+    {
+        if (!epoll)
+            throw std::runtime_error("epoll_create1");
+    }
+
+    id_t add(int fd, std::uint32_t events, handler_t handler)
+    {
+        id_t id = next_id++;
+
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.u64 = id;
+
+        if (::epoll_ctl(epoll.fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            throw std::runtime_error("epoll_ctl: add");
+
+        sources.emplace(id, source_t{ fd, std::move(handler) });
+        return id;
+    }
+
+    void mod(id_t id, std::uint32_t events)
+    {
+        auto it = sources.find(id);
+        if (it == sources.end() || it->second.dead)
+            return;
+
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.u64 = id;
+
+        if (::epoll_ctl(epoll.fd, EPOLL_CTL_MOD, it->second.fd, &ev) == -1)
+            throw std::runtime_error("epoll_ctl: mod");
+    }
+
+    // Replaces the handler of a source, its registration stays as it is.
+    void rebind(id_t id, handler_t handler)
+    {
+        auto it = sources.find(id);
+        if (it != sources.end() && !it->second.dead)
+            it->second.handler = std::move(handler);
+    }
+
+    // Must be called before the descriptor is closed. The handler itself is
+    // destroyed only after the current batch, so a handler may remove its
+    // own source.
+    void del(id_t id)
+    {
+        auto it = sources.find(id);
+        if (it == sources.end() || it->second.dead)
+            return;
+
+        ::epoll_ctl(epoll.fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        it->second.dead = true;
+        dead.push_back(id);
+    }
+
+    void stop() { running = false; }
+
+    void run()
+    {
+        std::array<struct epoll_event, 64> events;
+
+        running = true;
+        while (running)
+        {
+            int n = ::epoll_wait(epoll.fd, events.data(), events.size(), -1);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("epoll_wait");
+            }
+
+            for (int i = 0; i < n && running; ++i)
+            {
+                auto it = sources.find(events[i].data.u64);
+                if (it == sources.end() || it->second.dead)
+                    continue;
+
+                // a source which fails is logged, the others are served on
+                try
+                {
+                    it->second.handler(events[i].events);
+                }
+                catch (const std::exception& e)
+                {
+                    log_err(e.what());
+                }
+            }
+
+            for (id_t id : dead)
+                sources.erase(id);
+            dead.clear();
+        }
+    }
+};
@@ -3,23 +3,65 @@
 // headers
 #include "fd.hpp"       // fd_t
 
+// posix
+#include <sys/socket.h> // sendmsg, MSG_NOSIGNAL
+#include <sys/uio.h>    // iovec
+
 // c
 #include <cstdio>       // snprintf
-#include <cstring>      // strncpy, strncat
+#include <cstring>      // strlen, memcpy, memchr, strncpy
 #include <cerrno>       // errno
+#include <cstdint>      // uint8_t, uint32_t
 
 // cpp
+#include <algorithm>    // count
 #include <array>        // array
+#include <string>       // string
 #include <vector>       // vector
 #include <optional>     // optional
+#include <stdexcept>    // runtime_error
 
 
+/*
+ * Wire format of a message, native byte order (it never leaves the host):
+ *
+ *  ┌───────┬─────────┬───────┬─────┬───────┬──────┬───────────────────────┐
+ *  │ magic │ version │ flags │ id  │ count │ size │ arg\0 line\0 line\0 ..│
+ *  │  2 B  │   1 B   │  1 B  │ 4 B │  4 B  │  4 B │        size B         │
+ *  └───────┴─────────┴───────┴─────┴───────┴──────┴───────────────────────┘
+ *
+ * ‹id› is chosen by the client, replies carry the id of their request, so
+ * that many requests may be in flight on one connection and answered in
+ * any order. ‹count› is the number of lines. The whole message is written
+ * by a single sendmsg call, and parsed from a receive buffer kept by the
+ * reader.
+ */
 struct message
 {
-    static constexpr size_t Block = 256;
+    // an unversioned peer reads the leading zero as a request without
+    // arguments, so it still answers and the mismatch can be reported
+    static constexpr char Magic[2] = { '\0', 'S' };
+    static constexpr std::uint8_t Version = 2;
+    static constexpr std::uint32_t MaxSize = 64 << 20;
+
+    // flags
+    static constexpr std::uint8_t More = 0x1;   // partial reply, more follow
+
+    struct header_t
+    {
+        char magic[2];
+        std::uint8_t version;
+        std::uint8_t flags;
+        std::uint32_t id;
+        std::uint32_t count;
+        std::uint32_t size;
+    };
 
-    char arg[Block] = { 0 };
-    std::vector<std::array<char, Block>> contents = {};
+    std::string arg = {};
+    std::string body = {};                  // lines, each ends with '\0'
+    std::vector<std::uint32_t> starts = {}; // offset of each line in body
+    std::uint32_t id = 0;
+    bool more = false;
 
     message() = default;
 
@@ -34,72 +76,231 @@ struct message
     {
         set_arg(arg_);
         if (nxt)
+            add_line(nxt);
+    }
+
+    void set_arg(const char* arg_) { arg = arg_; }
+
+    size_t size() const { return starts.size(); }
+
+    // a missing line reads as empty, so a command given too few arguments
+    // cannot read past the message
+    const char* line(size_t i) const
+    {
+        return i < starts.size() ? body.data() + starts[i] : "";
+    }
+
+    header_t header() const
+    {
+        return header_t{ { Magic[0], Magic[1] }, Version,
+                         std::uint8_t(more ? More : 0), id,
+                         std::uint32_t(starts.size()),
+                         std::uint32_t(arg.size() + 1 + body.size()) };
+    }
+
+    size_t wire_size() const { return sizeof(header_t) + header().size; }
+
+    // Appends the wire representation of the message, without its first
+    // ‹skip› bytes.
+    void serialize(std::string& out, size_t skip = 0) const
+    {
+        auto head = header();
+        auto iov = iovecs(head);
+
+        for (const auto& v : iov)
         {
-            contents.emplace_back(std::array<char, Block>{ 0 });
-            std::strncpy(line(0), nxt, Block);
+            size_t n = std::min(skip, v.iov_len);
+            skip -= n;
+            out.append(static_cast<const char*>(v.iov_base) + n,
+                       v.iov_len - n);
         }
     }
 
-    void set_arg(const char* arg_) { std::strncpy(arg, arg_, Block); }
+    // A single sendmsg, returns the number of bytes written, which may be
+    // less than wire_size() on a non-blocking socket, or -1.
+    ssize_t write(fd_t& out) const
+    {
+        auto head = header();
+        auto iov = iovecs(head);
 
-    const char* line(size_t i) const { return contents[i].data(); }
-          char* line(size_t i)       { return contents[i].data(); }
+        struct msghdr mh = {};
+        mh.msg_iov = iov.data();
+        mh.msg_iovlen = iov.size();
 
-    auto send(fd_t& out) -> std::optional<int>
+        ssize_t w;
+        do
+            w = ::sendmsg(out.fd, &mh, MSG_NOSIGNAL);
+        while (w == -1 && errno == EINTR);
+        return w;
+    }
+
+    // Parses a message from the front of the buffer. Returns the number of
+    // bytes consumed, or 0 if the buffer doesn't hold a whole message yet.
+    // Throws on a malformed message.
+    size_t parse(const char* data, size_t len)
     {
-        unsigned char size = contents.size();
-        if (out.write(reinterpret_cast<char*>(&size), 1) == -1)
-            return { errno };
+        header_t head;
+        if (legacy(data, len))
+            throw std::runtime_error("protocol: the peer uses the old "
+                                     "unversioned protocol, upgrade it");
+        if (len < sizeof(head))
+            return 0;
 
-        if (out.write(reinterpret_cast<char*>(&arg), sizeof(arg) - 1) == -1)
-            return { errno };
+        std::memcpy(&head, data, sizeof(head));
 
-        for (size_t i = 0; i < size; ++i)
+        if (head.version != Version)
+            throw std::runtime_error("protocol: version "
+                                     + std::to_string(head.version)
+                                     + ", expected "
+                                     + std::to_string(Version));
+        if (head.size > MaxSize)
+            throw std::runtime_error("protocol: message too large");
+
+        if (len < sizeof(head) + head.size)
+            return 0;
+
+        const char* payload = data + sizeof(head);
+        if (head.size == 0 || payload[head.size - 1] != '\0'
+                || std::count(payload, payload + head.size, '\0')
+                    != std::ptrdiff_t(head.count) + 1)
+            throw std::runtime_error("protocol: malformed message");
+
+        size_t arg_len = std::strlen(payload);
+        arg.assign(payload, arg_len);
+        body.assign(payload + arg_len + 1, head.size - arg_len - 1);
+        more = head.flags & More;
+        id = head.id;
+
+        starts.clear();
+        starts.reserve(head.count);
+        for (size_t pos = 0; pos < body.size(); )
         {
-            if (out.write(line(i), Block - 1) == -1)
-                return { errno };
+            starts.push_back(pos);
+            pos += std::strlen(body.data() + pos) + 1;
         }
 
-        return {};
+        return sizeof(head) + head.size;
     }
 
-    auto recv(fd_t& in) -> std::optional<int>
+    // Blocking; sends the whole message.
+    auto send(fd_t& out) const -> std::optional<int>
     {
-        contents.clear();
-
-        unsigned char size = 0;
-        if (in.read(reinterpret_cast<char*>(&size), 1) == -1)
+        ssize_t w = write(out);
+        if (w == -1)
             return { errno };
 
-        auto r = in.read(reinterpret_cast<char*>(&arg), sizeof(arg) - 1);
-        if (r == -1)
-            return { errno };
+        if (size_t(w) == wire_size())
+            return {};
 
-        arg[r] = '\0';
+        // the rest did not fit in the socket buffer
+        auto rest = std::string{};
+        serialize(rest, w);
 
-        for (size_t i = 0; i < size; ++i)
+        size_t done = 0;
+        while (done < rest.size())
         {
-            contents.emplace_back(std::array<char, Block>{ 0 });
-            if (in.read(contents.back().data(), Block - 1) == -1)
+            auto r = ::send(out.fd, rest.data() + done, rest.size() - done,
+                            MSG_NOSIGNAL);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r == -1)
                 return { errno };
+            done += r;
         }
-
         return {};
     }
 
+    // Blocking; ‹buf› keeps what was read past the end of this message,
+    // it is to be passed to the next recv on the same descriptor.
+    auto recv(fd_t& in, std::string& buf) -> std::optional<int>
+    {
+        while (true)
+        {
+            if (size_t used = parse(buf.data(), buf.size()))
+            {
+                buf.erase(0, used);
+                return {};
+            }
+
+            size_t have = buf.size();
+            buf.resize(have + 16384);
+
+            auto r = in.read(buf.data() + have, buf.size() - have);
+            buf.resize(have + std::max<ssize_t>(r, 0));
+
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r == -1)
+                return { errno };
+            if (r == 0)
+                return { ECONNRESET };
+        }
+    }
+
     template<typename ... Args>
     int add_line(const char* fmt, Args&& ... args)
     {
-        contents.emplace_back(std::array<char, Block>{ 0 });
-        return std::snprintf(contents.back().data(), Block, fmt,
-                             std::forward<Args>(args)...);
+        int len = std::snprintf(nullptr, 0, fmt, args...);
+        if (len < 0)
+            return len;
+
+        size_t at = body.size();
+        body.resize(at + len + 1);
+        std::snprintf(&body[at], len + 1, fmt, args...);
+        starts.push_back(at);
+        return len;
     }
 
     int add_line(const char* str)
     {
-        contents.emplace_back(std::array<char, Block>{ 0 });
-        std::strncat(contents.back().data(), str, Block);
-        // TODO: use strnlen
-        return Block;
+        return add_raw(str, std::strlen(str));
+    }
+
+    // ‹len› bytes of ‹str› as they are, not a format; a distinct name, so
+    // that a format with a single size_t argument is never taken for them
+    int add_raw(const char* str, size_t len)
+    {
+        // a line cannot contain the separator
+        if (const void* nul = std::memchr(str, '\0', len))
+            len = static_cast<const char*>(nul) - str;
+
+        starts.push_back(body.size());
+        body.append(str, len);
+        body.push_back('\0');
+        return len;
+    }
+
+    static bool legacy(const char* data, size_t len)
+    {
+        return (len >= 1 && data[0] != Magic[0])
+            || (len >= 2 && data[1] != Magic[1]);
+    }
+
+    // Size of a request in that protocol, from its first byte.
+    static size_t legacy_size(const char* data)
+    {
+        return 1 + (static_cast<unsigned char>(data[0]) + 1) * 255;
+    }
+
+    // The reply to a client speaking the fixed 256 B block protocol, which
+    // preceded versioning. Such clients can at least show why they failed.
+    static std::string legacy_error(const char* what)
+    {
+        constexpr size_t Block = 255;
+
+        auto out = std::string(1 + 2 * Block, '\0');
+        out[0] = 1;
+        std::strncpy(&out[1], "error", Block - 1);
+        std::strncpy(&out[1 + Block], what, Block - 1);
+        return out;
+    }
+
+private:
+    std::array<struct iovec, 3> iovecs(const header_t& head) const
+    {
+        // both strings are followed by '\0', arg's is a part of the message
+        return { { { const_cast<header_t*>(&head), sizeof(head) },
+                   { const_cast<char*>(arg.c_str()), arg.size() + 1 },
+                   { const_cast<char*>(body.data()), body.size() } } };
     }
 };
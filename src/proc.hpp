@@ -2,75 +2,334 @@
 
 // kill
 #define _POSIX_C_SOURCE 200809L
+// syscall
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 // header
 #include "log.hpp"          // *log*
 #include "fd.hpp"           // fd_t
 
 // posix
-#include <sys/wait.h>       // kill, waitpid
+#include <sys/wait.h>       // kill, waitpid, wait4
+#include <sys/resource.h>   // rusage, getrlimit
 #include <sys/types.h>      //       waitpid, fork
-#include <unistd.h>         //                fork, exec*
-#include <unistd.h>         // open, close, dup2
-#include <sys/types.h>      // open
-#include <fcntl.h>          // open
-#include <signal.h>         // kill
+#include <unistd.h>         //                fork, exec*, environ
+#include <unistd.h>         // close, dup2, dup3, close_range
+#include <fcntl.h>          // fcntl, O_CLOEXEC
+#include <signal.h>         // kill, sigprocmask, SIG*
 #include <sys/prctl.h>      // prctl
+#include <sys/syscall.h>    // SYS_pidfd_*
+#include <sched.h>          // clone, CLONE_*
+#include <spawn.h>          // posix_spawn*
 
 // c
 #include <cstdlib>          // exit
 #include <cerrno>           // errno
+#include <cstring>          // strerror
 
 // cpp
+#include <algorithm>        // max, none_of
 #include <stdexcept>        // runtime_error
 #include <variant>          // variant
 #include <vector>           // vector
 #include <filesystem>       // fs::*
-#include <utility>          // exchange
+#include <string>           // string
+#include <utility>          // exchange, pair
 #include <map>              // map
 
 
 struct e_exit { int ret; };
 struct e_sig  { int sig; };
 
+using exit_t = std::variant<e_exit, e_sig>;
 
-struct proc_t
+
+inline int pidfd_open(pid_t pid)
 {
-    pid_t pid = -1;
+    return ::syscall(SYS_pidfd_open, pid, 0);
+}
 
-    proc_t(char* const argv[],
-           const std::filesystem::path& cwd,
-           const std::map<int, std::filesystem::path>& redir = {},
-           const std::vector<int>& to_close = {})
+
+inline int pidfd_send_signal(int pidfd, int sig)
+{
+    return ::syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0);
+}
+
+
+// An executable found beforehand, so that the exec does not search PATH.
+struct exe_t
+{
+    int fd = -1;                    // O_PATH, -1 to search
+    const char* path = nullptr;     // where it was found
+};
+
+
+// What a child is set up with before the exec, flattened beforehand, so
+// that the child only makes system calls.
+struct spawn_t
+{
+    char* const* argv;
+    const char* cwd;
+    std::vector<std::pair<int, int>> dups{};    // target, fd
+    exe_t exe{};
+    bool group = false; // the child leads a process group of its own
+    int err = 0;    // errno of a failed exec, if the child shares memory
+};
+
+
+// Marks every fd from ‹low› up to be closed on exec.
+inline int cloexec_from(int low)
+{
+    if (::close_range(low, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+        return 0;
+
+    // before Linux 5.11
+    struct rlimit lim;
+    if (::getrlimit(RLIMIT_NOFILE, &lim) == -1)
+        return errno;
+    for (rlim_t fd = low; fd < lim.rlim_cur; ++fd)
+        ::fcntl(int(fd), F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+
+// Runs in the child, returns only if the exec fails, with errno. The child
+// gets no fds but 0, 1, 2 and those of ‹dups›, whatever else the daemon,
+// or the spawn helper, had open.
+inline int spawn_exec(const spawn_t& s)
+{
+    if (::prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+        return errno;
+    if (s.group && ::setpgid(0, 0) == -1)
+        return errno;
+
+    // the daemon keeps its signals blocked for signalfd and
+    // ignores SIGPIPE, both would otherwise survive the exec
+    sigset_t none;
+    ::sigemptyset(&none);
+    ::signal(SIGPIPE, SIG_DFL);
+    ::sigprocmask(SIG_SETMASK, &none, nullptr);
+
+    // the sources are copied above every fd involved first, so that no dup
+    // overwrites the source of another, nor the executable
+    int above = std::max(3, s.exe.fd + 1);
+    for (auto [target, fd] : s.dups)
+        above = std::max({ above, target + 1, fd + 1 });
+
+    for (size_t i = 0; i < s.dups.size(); ++i)
+        if (::dup3(s.dups[i].second, above + int(i), O_CLOEXEC) == -1)
+            return errno;
+
+    if (int err = cloexec_from(3); err != 0)
+        return err;
+
+    // dup2 clears close-on-exec of the target
+    for (size_t i = 0; i < s.dups.size(); ++i)
+        ::dup2(above + int(i), s.dups[i].first);
+
+    if (::chdir(s.cwd) == -1)
+        return errno;
+
+    // a script is not run from a descriptor closed on exec, its interpreter
+    // could not open it, it is run from the path found then
+    if (s.exe.fd != -1)
+        ::syscall(SYS_execveat, s.exe.fd, "", s.argv, environ, AT_EMPTY_PATH);
+    if (s.exe.path)
+        ::execv(s.exe.path, s.argv);
+    else
+        ::execvp(s.argv[0], s.argv);
+    return errno;
+}
+
+
+/*
+ * Spawn engines, each returns the pid of the child and its pidfd in
+ * ‹pidfd›, and throws if there is no child. If the child cannot be
+ * executed, it exits with 1 (clone, fork) or nothing is spawned
+ * (posix_spawn).
+ *
+ * proc_t uses the one chosen at build time, by ‹make SPAWN=ENGINE›.
+ */
+
+// The copy of the daemon's address space is only the cost of its page
+// tables, but that grows with the daemon, and is paid by every spawn.
+inline pid_t spawn_fork(spawn_t& s, int& pidfd)
+{
+    pid_t pid = ::fork();
+
+    if (pid == -1)
+        throw std::runtime_error("fork");
+
+    if (pid == 0)
+    {
+        log_errno(spawn_exec(s));
+        std::exit(1);
+    }
+
+    // the group is there before the parent can signal it
+    if (s.group)
+        ::setpgid(pid, pid);
+
+    // the child cannot be reaped before we wait for it,
+    // so the pid cannot have been reused yet
+    pidfd = pidfd_open(pid);
+    if (pidfd == -1)
     {
-        pid = ::fork();
+        ::kill(pid, SIGKILL);
+        ::waitpid(pid, nullptr, 0);
+        throw std::runtime_error("pidfd_open");
+    }
+    return pid;
+}
 
-        if (pid == -1)
-            throw std::runtime_error("fork");
 
-        if (pid == 0)
-        {
-            if (::prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
-                log_errno(errno);
+// As vfork, the child runs in the caller's memory, on a stack of its own,
+// while the caller waits for its exec. The pidfd comes with the child.
+// Returns -1 and sets errno if there is no child.
+inline pid_t clone_exec(spawn_t& s, int& pidfd, int flags = 0)
+{
+    // one child at a time, the caller is suspended until the exec
+    alignas(64) static char stack[64 << 10];
+
+    // no handler may run in the child, before it resets its mask
+    sigset_t all, old;
+    ::sigfillset(&all);
+    ::sigprocmask(SIG_SETMASK, &all, &old);
+
+    pidfd = -1;
+    s.err = 0;
+    pid_t pid = ::clone([](void* arg)
+                        {
+                            auto& s = *static_cast<spawn_t*>(arg);
+                            s.err = spawn_exec(s);
+                            ::_exit(1);
+                            return 0;
+                        },
+                        stack + sizeof(stack),
+                        CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD
+                            | flags,
+                        &s, &pidfd);
+    int err = errno;
+
+    ::sigprocmask(SIG_SETMASK, &old, nullptr);
+    errno = err;
+    return pid;
+}
+
+
+inline pid_t spawn_clone(spawn_t& s, int& pidfd)
+{
+    pid_t pid = clone_exec(s, pidfd);
+    if (pid == -1)
+        throw std::runtime_error(std::string{ "clone: " }
+                                 + std::strerror(errno));
+
+    // the child is gone, it is reaped as any other
+    if (s.err != 0)
+        log_err("exec '", s.argv[0], "': ", std::strerror(s.err));
+    return pid;
+}
+
+
+// Leaves the setup to libc. There is no PR_SET_PDEATHSIG, the children
+// outlive a daemon which is killed, and no execveat, an executable found
+// beforehand is run from its path.
+inline pid_t spawn_posix(spawn_t& s, int& pidfd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    ::posix_spawn_file_actions_init(&actions);
+    ::posix_spawnattr_init(&attr);
+
+    for (auto [target, fd] : s.dups)
+        ::posix_spawn_file_actions_adddup2(&actions, fd, target);
+
+    // everything else above 2 is closed, after the dups
+    int top = 2;
+    for (auto [target, fd] : s.dups)
+        top = std::max(top, target);
+    for (int fd = 3; fd <= top; ++fd)
+        if (std::none_of(s.dups.begin(), s.dups.end(),
+                         [fd](auto d) { return d.first == fd; }))
+            ::posix_spawn_file_actions_addclose(&actions, fd);
+    ::posix_spawn_file_actions_addclosefrom_np(&actions, top + 1);
+    ::posix_spawn_file_actions_addchdir_np(&actions, s.cwd);
+
+    sigset_t none, all;
+    ::sigemptyset(&none);
+    ::sigfillset(&all);
+    ::posix_spawnattr_setsigmask(&attr, &none);
+    ::posix_spawnattr_setsigdefault(&attr, &all);
+    ::posix_spawnattr_setpgroup(&attr, 0);
+    ::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK
+                                    | POSIX_SPAWN_SETSIGDEF
+                                    | (s.group ? POSIX_SPAWN_SETPGROUP : 0));
+
+    pid_t pid;
+    int err = s.exe.path
+            ? ::posix_spawn(&pid, s.exe.path, &actions, &attr, s.argv, environ)
+            : ::posix_spawnp(&pid, s.argv[0], &actions, &attr, s.argv,
+                             environ);
+
+    ::posix_spawn_file_actions_destroy(&actions);
+    ::posix_spawnattr_destroy(&attr);
+
+    if (err != 0)
+        throw std::runtime_error(std::string{ "posix_spawn: " }
+                                 + std::strerror(err));
+
+    pidfd = pidfd_open(pid);
+    if (pidfd == -1)
+    {
+        ::kill(pid, SIGKILL);
+        ::waitpid(pid, nullptr, 0);
+        throw std::runtime_error("pidfd_open");
+    }
+    return pid;
+}
+
 
-            for (const auto& [fd, filename] : redir)
-            {
-                fd_t file = ::open(filename.c_str(),
-                                   O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                file.dup2(fd).reset();
-            }
+#if defined(SPAWN_FORK)
+inline constexpr auto spawn = spawn_fork;
+#elif defined(SPAWN_POSIX_SPAWN)
+inline constexpr auto spawn = spawn_posix;
+#else
+inline constexpr auto spawn = spawn_clone;
+#endif
 
-            for (int fd : to_close)
-                // fd_t{ fd }.close();
-                ::close(fd);
 
-            std::filesystem::current_path(cwd);
+// How proc_t spawns, srvd replaces it by its spawn helper.
+inline pid_t (*spawner)(spawn_t&, int&) = spawn;
 
-            ::execvp(argv[0], argv);
 
-            log_errno(errno);
-            std::exit(1);
-        }
+struct proc_t
+{
+    pid_t pid = -1;
+    fd_t pidfd{ -1 };   // readable once the process exits
+    bool group = false; // signals go to the whole process group of the child
+
+    // ‹inherit› are fds of the daemon the child keeps, under their numbers.
+    proc_t(char* const argv[],
+           const std::filesystem::path& cwd,
+           const std::vector<int>& inherit = {},
+           const std::map<int, int>& dups = {},
+           exe_t exe = {},
+           bool group = false)
+        : group(group)
+    {
+        auto s = spawn_t{ argv, cwd.c_str() };
+        s.exe = exe;
+        s.group = group;
+        for (auto [target, fd] : dups)
+            s.dups.emplace_back(target, fd);
+        for (int fd : inherit)
+            s.dups.emplace_back(fd, fd);
+
+        int fd = -1;
+        pid = spawner(s, fd);
+        pidfd = fd;
     }
 
     proc_t(const proc_t&) = delete;
@@ -78,11 +337,15 @@ struct proc_t
 
     proc_t(proc_t&& other) noexcept
         : pid(std::exchange(other.pid, -1))
+        , pidfd(std::move(other.pidfd))
+        , group(other.group)
     { }
 
     proc_t& operator=(proc_t&& other) noexcept
     {
         pid = std::exchange(other.pid, -1);
+        pidfd = std::move(other.pidfd);
+        group = other.group;
         return *this;
     }
 
@@ -91,13 +354,9 @@ struct proc_t
         if (pid == -1)
             return;
 
+        // not wait(), a destructor must not throw
         proc_t::signal(SIGKILL);
-        proc_t::wait();
-    }
-
-    bool zombie() const
-    {
-        return pid != -1 && !running();
+        ::waitpid(pid, nullptr, 0);
     }
 
     bool running() const
@@ -111,18 +370,20 @@ struct proc_t
         return info.si_pid != pid;
     }
 
-    auto wait() -> std::variant<e_exit, e_sig>
+    // ‹usage›, if given, receives the resources used by the child.
+    exit_t wait(struct rusage* usage = nullptr)
     {
         if (pid == -1)
             throw std::runtime_error("proc_t::wait");
 
         int status{};
-        pid_t r = ::waitpid(pid, &status, 0);
+        pid_t r = ::wait4(pid, &status, 0, usage);
 
         if (r == -1)
             throw std::runtime_error("waitpid");
 
         pid = -1;
+        pidfd.close();
 
         if (WIFEXITED(status))
             return e_exit{ WEXITSTATUS(status) };
@@ -133,12 +394,20 @@ struct proc_t
         throw std::runtime_error("proc_t::wait: invalid state");
     }
 
-    void signal(int sig)
+    // Returns 0, or the errno of the failure, for the caller to report.
+    int signal(int sig)
     {
         if (pid == -1)
-            return;
+            return 0;
+
+        // the group keeps its id while its leader is not reaped
+        if (group)
+            return ::kill(-pid, sig) == -1 ? errno : 0;
 
-        if (::kill(pid, sig) == -1)
-            throw std::runtime_error("kill");
+        // unlike kill, this can never hit an unrelated process
+        // that happened to reuse the pid
+        if (pidfd_send_signal(pidfd.fd, sig) == -1)
+            return errno;
+        return 0;
     }
 };
@@ -0,0 +1,359 @@
+#pragma once
+
+// headers
+#include "common.hpp"   // app_t
+#include "proc.hpp"     // exit_t
+
+// posix
+#include <sys/types.h>  // pid_t
+#include <fnmatch.h>    // fnmatch
+
+// c
+#include <cstdint>      // uint32_t, uint64_t, UINT32_MAX
+
+// cpp
+#include <algorithm>    // sort, lower_bound, upper_bound, set_intersection
+#include <functional>   // less
+#include <iterator>     // back_inserter
+#include <map>          // map
+#include <optional>     // optional
+#include <string>       // string, to_string
+#include <string_view>  // string_view
+#include <utility>      // move
+#include <vector>       // vector
+
+
+/*
+ * The apps known to the daemon, each under a dense integer id, so that
+ * the state of an app and of its running instance share one slot.
+ *
+ * Names are interned in one buffer and found through an open-addressing
+ * index (linear probing, at most half full). The fields read by every
+ * command are kept in arrays of their own, the rest of the configuration
+ * in ‹apps›. Apps are only ever added, a changed configuration makes a new
+ * registry.
+ *
+ * Labels are indexed as they are added, from each key and value to the ids
+ * of the apps with it, so that a selector is resolved from the ids of its
+ * terms rather than by testing every app.
+ */
+struct registry_t
+{
+    using id_t = std::uint32_t;
+    static constexpr id_t none = UINT32_MAX;
+
+    // Ids are valid only within one registry, clients get them as handles
+    // ‹@EPOCH:ID›, and a new configuration gets a new epoch.
+    std::uint32_t epoch = 0;
+
+    // hot, one slot per app; the app is running iff its pid is not -1
+    std::vector<pid_t> pid{};
+    std::vector<std::optional<exit_t>> exit{};      // of the last run
+
+    // cold
+    std::vector<app_t> apps{};
+
+    size_t size() const { return apps.size(); }
+
+    bool running(id_t id) const { return pid[id] != -1; }
+
+    std::string_view name(id_t id) const
+    {
+        return { names.data() + name_at[id], name_len[id] };
+    }
+
+    void reserve(size_t count)
+    {
+        pid.reserve(count);
+        exit.reserve(count);
+        apps.reserve(count);
+        name_at.reserve(count);
+        name_len.reserve(count);
+
+        size_t capacity = 16;
+        while (capacity < 2 * count)
+            capacity *= 2;
+        if (capacity > index.size())
+            rehash(capacity);
+    }
+
+    // Returns the id of the new app, or ‹none› if the name is taken.
+    id_t add(std::string_view key, app_t app)
+    {
+        if (find(key) != none)
+            return none;
+
+        if (2 * (size() + 1) > index.size())
+            rehash(std::max<size_t>(16, 2 * index.size()));
+
+        auto id = id_t(size());
+        name_at.push_back(names.size());
+        name_len.push_back(key.size());
+        names.append(key);
+        names.push_back('\0');
+
+        // a key given twice keeps its first value
+        auto& labels = app.labels;
+        std::stable_sort(labels.begin(), labels.end(),
+                         [](const auto& a, const auto& b)
+        {
+            return a.first < b.first;
+        });
+        labels.erase(std::unique(labels.begin(), labels.end(),
+                                 [](const auto& a, const auto& b)
+        {
+            return a.first == b.first;
+        }), labels.end());
+
+        for (const auto& [k, v] : labels)
+            by_label[k][v].push_back(id);
+
+        pid.push_back(-1);
+        exit.emplace_back();
+        apps.push_back(std::move(app));
+
+        insert(id, hash(key));
+        sorted.clear();
+        return id;
+    }
+
+    id_t find(std::string_view key) const
+    {
+        if (index.empty())
+            return none;
+
+        auto h = hash(key);
+        size_t mask = index.size() - 1;
+        for (size_t i = h & mask; ; i = (i + 1) & mask)
+        {
+            const auto& slot = index[i];
+            if (slot.id == none)
+                return none;
+            if (slot.hash == std::uint32_t(h) && name(slot.id) == key)
+                return slot.id;
+        }
+    }
+
+    // Ids in the order of names.
+    const std::vector<id_t>& by_name() const
+    {
+        if (sorted.size() != size())
+        {
+            sorted.resize(size());
+            for (id_t id = 0; id < size(); ++id)
+                sorted[id] = id;
+            std::sort(sorted.begin(), sorted.end(), [this](id_t a, id_t b)
+            {
+                return name(a) < name(b);
+            });
+        }
+        return sorted;
+    }
+
+    // The value of the app's label, if it has it.
+    std::optional<std::string_view> label(id_t id, std::string_view key) const
+    {
+        const auto& labels = apps[id].labels;
+        auto it = std::lower_bound(labels.begin(), labels.end(), key,
+                                   [](const auto& l, std::string_view k)
+        {
+            return l.first < k;
+        });
+        if (it == labels.end() || it->first != key)
+            return {};
+        return it->second;
+    }
+
+    // The apps matching a selector, in the order of ids. A selector is a
+    // list of terms separated by ',', all of which must hold:
+    //
+    //     KEY=VALUE   KEY!=VALUE   KEY (has the label)   !KEY (has not)
+    //
+    // where the key ‹name› matches the name of the app against a glob.
+    // Returns false if the selector is malformed.
+    bool select(std::string_view expr, std::vector<id_t>& ids) const
+    {
+        struct term_t
+        {
+            std::string_view key;
+            std::optional<std::string_view> value;  // none to test the key
+            bool negated;
+            std::string glob{};     // the value of ‹name›, terminated
+        };
+
+        auto trim = [](std::string_view s)
+        {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+                s.remove_prefix(1);
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+                s.remove_suffix(1);
+            return s;
+        };
+
+        auto terms = std::vector<term_t>{};
+        while (true)
+        {
+            size_t comma = expr.find(',');
+            auto term = trim(expr.substr(0, comma));
+            auto t = term_t{ term, {}, false };
+
+            if (size_t op = term.find("!="); op != std::string_view::npos)
+                t = term_t{ trim(term.substr(0, op)),
+                            trim(term.substr(op + 2)), true };
+            else if (size_t op = term.find('='); op != std::string_view::npos)
+                t = term_t{ trim(term.substr(0, op)),
+                            trim(term.substr(term.compare(op, 2, "==") == 0
+                                             ? op + 2 : op + 1)), false };
+            else if (!term.empty() && term.front() == '!')
+                t = term_t{ trim(term.substr(1)), {}, true };
+
+            if (t.key.empty() || (t.key == "name" && !t.value))
+                return false;
+            if (t.key == "name")
+                t.glob = *t.value;
+            terms.push_back(t);
+
+            if (comma == std::string_view::npos)
+                break;
+            expr.remove_prefix(comma + 1);
+        }
+
+        // the ids of each positive term, from the index
+        auto lists = std::vector<std::vector<id_t>>{};
+        for (const auto& t : terms)
+        {
+            if (t.negated || t.key == "name")
+                continue;
+
+            auto& list = lists.emplace_back();
+            auto values = by_label.find(t.key);
+            if (values == by_label.end())
+                continue;
+
+            if (t.value)
+            {
+                auto it = values->second.find(*t.value);
+                if (it != values->second.end())
+                    list = it->second;
+                continue;
+            }
+
+            for (const auto& [v, with] : values->second)
+                list.insert(list.end(), with.begin(), with.end());
+            std::sort(list.begin(), list.end());
+        }
+
+        // intersected from the shortest one
+        std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b)
+        {
+            return a.size() < b.size();
+        });
+
+        auto found = std::vector<id_t>{};
+        if (lists.empty())
+        {
+            found.resize(size());
+            for (id_t id = 0; id < size(); ++id)
+                found[id] = id;
+        }
+        else
+        {
+            found = std::move(lists[0]);
+            for (size_t i = 1; i < lists.size() && !found.empty(); ++i)
+            {
+                auto both = std::vector<id_t>{};
+                std::set_intersection(found.begin(), found.end(),
+                                      lists[i].begin(), lists[i].end(),
+                                      std::back_inserter(both));
+                found = std::move(both);
+            }
+        }
+
+        // the rest is tested on the apps found
+        ids.clear();
+        for (id_t id : found)
+        {
+            bool ok = true;
+            for (const auto& t : terms)
+            {
+                // names are stored with a terminating '\0'
+                if (t.key == "name")
+                    ok = (::fnmatch(t.glob.c_str(), name(id).data(), 0) == 0)
+                         != t.negated;
+                else if (t.negated)
+                {
+                    auto v = label(id, t.key);
+                    ok = t.value ? v != t.value : !v;
+                }
+
+                if (!ok)
+                    break;
+            }
+            if (ok)
+                ids.push_back(id);
+        }
+        return true;
+    }
+
+    std::string handle(id_t id) const
+    {
+        return "@" + std::to_string(epoch) + ":" + std::to_string(id);
+    }
+
+    // Position in by_name() of the first app named after ‹key›.
+    size_t after(std::string_view key) const
+    {
+        const auto& ids = by_name();
+        return std::upper_bound(ids.begin(), ids.end(), key,
+                                [this](std::string_view k, id_t id)
+        {
+            return k < name(id);
+        }) - ids.begin();
+    }
+
+private:
+    struct slot_t
+    {
+        std::uint32_t hash;
+        id_t id = none;
+    };
+
+    std::string names{};                    // each followed by '\0'
+    std::vector<std::uint32_t> name_at{};
+    std::vector<std::uint32_t> name_len{};
+    std::vector<slot_t> index{};            // size is a power of two
+    mutable std::vector<id_t> sorted{};     // made when needed
+
+    // label key to value to the ids of the apps with it, ascending
+    std::map<std::string,
+             std::map<std::string, std::vector<id_t>, std::less<>>,
+             std::less<>> by_label{};
+
+    // FNV-1a
+    static std::uint64_t hash(std::string_view key)
+    {
+        std::uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : key)
+            h = (h ^ c) * 1099511628211ull;
+        return h;
+    }
+
+    void insert(id_t id, std::uint64_t h)
+    {
+        size_t mask = index.size() - 1;
+        size_t i = h & mask;
+        while (index[i].id != none)
+            i = (i + 1) & mask;
+        index[i] = slot_t{ std::uint32_t(h), id };
+    }
+
+    void rehash(size_t capacity)
+    {
+        index.assign(capacity, slot_t{});
+        for (id_t id = 0; id < size(); ++id)
+            insert(id, hash(name(id)));
+    }
+};
+
+
+using app_id = registry_t::id_t;
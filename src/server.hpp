@@ -0,0 +1,807 @@
+#pragma once
+
+// headers
+#include "common.hpp"   // app_t
+#include "registry.hpp" // registry_t, app_id
+#include "message.hpp"  // message
+#include "proc.hpp"     // proc_t
+#include "loop.hpp"     // loop_t
+#include "log.hpp"      // log_errno
+#include "fd.hpp"       // fd_t
+#include "status.hpp"   // status_writer_t
+#include "exe.hpp"      // exe_cache_t
+#include "logs.hpp"     // logs_t
+
+// posix
+#include <sys/epoll.h>  // EPOLL*
+#include <sys/socket.h> // accept4
+#include <sys/random.h> // getrandom
+#include <unistd.h>     // getpid
+#include <signal.h>     // SIGKILL
+
+// c
+#include <cerrno>       // errno
+#include <cstring>      // memcpy, memset
+#include <ctime>        // time
+
+// cpp
+#include <cstdint>      // uint32_t, uint64_t
+#include <cstddef>      // size_t
+#include <algorithm>    // max, min
+#include <exception>    // exception
+#include <functional>   // function, less
+#include <map>          // map
+#include <optional>     // optional
+#include <set>          // set
+#include <string>       // string
+#include <utility>      // move, forward, pair, swap
+#include <variant>      // get_if
+#include <vector>       // vector
+
+
+struct child_t
+{
+    proc_t proc;
+    loop_t::id_t watch;     // source of proc.pidfd in the loop
+    std::vector<std::function<void(const exit_t&)>> on_exit{};
+};
+
+
+using conn_id = std::uint64_t;
+
+
+/*
+ * A client connection, a non-blocking state machine. Requests are read
+ * and dispatched as they arrive, many of them may be in flight at once.
+ * Replies are queued in the order the commands produce them, each one
+ * carries the id of its request.
+ *
+ * Once the peer stops sending, the connection closes as soon as every
+ * pending request is answered and the replies are written out.
+ */
+struct conn_t
+{
+    // stop reading requests while this much is waiting to be written
+    static constexpr size_t TxLimit = 1 << 20;
+
+    fd_t sock;
+    loop_t::id_t watch = loop_t::none;
+    bool eof = false;       // the peer won't send more requests
+    std::string rx{};
+    std::string tx{};
+    size_t sent = 0;        // bytes of tx already written
+
+    // in-flight requests, with actions to take if the connection is gone
+    // before they are answered
+    std::map<std::uint32_t, std::vector<std::function<void()>>> pending{};
+
+    // called once everything queued so far is written
+    std::vector<std::function<void()>> on_drain{};
+
+    std::uint32_t interest() const
+    {
+        // hang-ups are always reported
+        std::uint32_t ev = 0;
+        if (!eof && tx.size() - sent < TxLimit)
+            ev |= EPOLLIN;
+        if (sent < tx.size())
+            ev |= EPOLLOUT;
+        return ev;
+    }
+
+    bool done() const
+    {
+        return eof && rx.empty() && pending.empty() && sent == tx.size();
+    }
+};
+
+
+// Identifies where the reply to a command should be delivered.
+struct reply_t
+{
+    conn_id conn;
+    std::uint32_t id;       // of the request
+};
+
+
+// A ‹watch› request, events are streamed to it as partial replies.
+struct watcher_t
+{
+    // events are dropped rather than queued past this much of backlog
+    static constexpr size_t Backlog = 64 << 10;
+
+    reply_t to;
+    std::optional<std::set<app_id>> apps{};     // none for all of them
+    std::uint64_t dropped = 0;      // since the last event delivered
+};
+
+
+// Random, not to be repeated by another run of the daemon, as a count from
+// the time would be by one started again soon enough.
+inline std::uint32_t random_u32()
+{
+    std::uint32_t val;
+    if (::getrandom(&val, sizeof(val), GRND_NONBLOCK) == sizeof(val))
+        return val;
+
+    // the pool is not ready this early after boot
+    return std::uint32_t(std::time(nullptr)) ^ (std::uint32_t(::getpid())
+                                                << 16);
+}
+
+
+struct server_t;
+
+using handle_ptr = void (*) (server_t&, const reply_t&, const message&);
+using config_ptr = registry_t (*) ();
+
+
+struct server_t
+{
+    registry_t apps;
+    std::vector<std::optional<child_t>> procs;     // by app id
+    std::map<conn_id, conn_t> conns;
+    conn_id next_conn = 0;
+    size_t max_clients = MAX_CLIENTS;
+    fd_t sock{ -1 };
+    loop_t::id_t sock_watch = loop_t::none;
+    bool paused = false;            // not accepting, until there is room
+    loop_t loop;
+    handle_ptr handle = nullptr;    // dispatches a received request
+    config_ptr config = nullptr;    // reads the configuration, to reload it
+    status_writer_t status;
+    exe_cache_t exes;               // of the apps, found at each load
+    loop_t::id_t exes_watch = loop_t::none;
+    logs_t logs;                    // the output of the apps
+    std::uint64_t generation = 0;   // bumped by each change of an app
+    std::uint32_t boot = random_u32();  // tells generations of runs apart
+    std::map<std::pair<conn_id, std::uint32_t>, watcher_t> watchers;
+
+    // differs across restarts of the daemon, so that old handles fail
+    std::uint32_t next_epoch = random_u32();
+
+    // called once, on the next start of the app, with its pid, or with -1
+    // if the app is removed from the configuration; by name, as ids change
+    // with the configuration
+    std::multimap<std::string, std::function<void(pid_t)>, std::less<>>
+        on_start;
+
+    // Takes over the apps of a configuration, with a new epoch, the ids of
+    // the previous one are no longer valid. Apps which stay keep their state
+    // and running instance, running instances of apps which are gone are
+    // killed. Everything is published on a new status page.
+    //
+    // What can fail is done before anything changes, so that a failure
+    // leaves the configuration loaded before as it was.
+    void load(registry_t fresh)
+    {
+        fresh.epoch = next_epoch++;
+
+        // the id each app has in the new configuration
+        auto moved = std::vector<app_id>(apps.size(), registry_t::none);
+        for (app_id old = 0; old < apps.size(); ++old)
+        {
+            auto id = moved[old] = fresh.find(apps.name(old));
+            if (id == registry_t::none)
+                continue;
+
+            auto& app = fresh.apps[id];
+            const auto& prev = apps.apps[old];
+            app.started = prev.started;
+            app.starts = prev.starts;
+            app.usage = prev.usage;
+            fresh.pid[id] = apps.pid[old];
+            fresh.exit[id] = apps.exit[old];
+        }
+
+        auto watched = std::vector<std::optional<std::set<app_id>>>{};
+        for (const auto& [key, watcher] : watchers)
+        {
+            auto& ids = watched.emplace_back();
+            if (!watcher.apps)
+                continue;
+
+            ids.emplace();
+            for (app_id old : *watcher.apps)
+                if (moved[old] != registry_t::none)
+                    ids->insert(moved[old]);
+        }
+
+        auto fresh_procs = std::vector<std::optional<child_t>>(fresh.size());
+        auto gone = std::vector<child_t>{};
+        gone.reserve(procs.size());
+
+        // executables are found once, and again only as they change
+        auto fresh_exes = exe_cache_t{};
+        fresh_exes.load(fresh);
+        auto fresh_exes_watch = !fresh_exes.notify ? loop_t::none
+                   : loop.add(fresh_exes.notify.fd, EPOLLIN, [this](uint32_t)
+        {
+            exes.on_events();
+        });
+
+        // the records are at the ids
+        try
+        {
+            if (!status.path.empty())
+                status.create(status.path, fresh.size());
+        }
+        catch (...)
+        {
+            loop.del(fresh_exes_watch);
+            throw;
+        }
+
+        for (app_id old = 0; old < apps.size(); ++old)
+        {
+            if (!procs[old])
+                continue;
+            if (moved[old] == registry_t::none)
+                gone.push_back(std::move(*procs[old]));
+            else
+                fresh_procs[moved[old]] = std::move(procs[old]);
+        }
+
+        auto ids = watched.begin();
+        for (auto& [key, watcher] : watchers)
+            watcher.apps = std::move(*ids++);
+
+        apps = std::move(fresh);
+        procs = std::move(fresh_procs);
+
+        // exits are to be delivered under the new ids
+        for (app_id id = 0; id < procs.size(); ++id)
+            if (procs[id])
+                loop.rebind(procs[id]->watch, exit_handler(id));
+
+        loop.del(exes_watch);
+        std::swap(exes, fresh_exes);
+        exes_watch = fresh_exes_watch;
+
+        for (app_id id = 0; id < apps.size(); ++id)
+            publish(id);
+
+        for (auto& child : gone)
+        {
+            loop.del(child.watch);
+            child.proc.signal(SIGKILL);
+            auto ex = child.proc.wait();
+            for (auto& func : child.on_exit)
+                func(ex);
+        }
+
+        auto hooks = std::vector<std::function<void(pid_t)>>{};
+        for (auto hook = on_start.begin(); hook != on_start.end(); )
+        {
+            if (apps.find(hook->first) != registry_t::none)
+            {
+                ++hook;
+                continue;
+            }
+            hooks.push_back(std::move(hook->second));
+            hook = on_start.erase(hook);
+        }
+
+        for (auto& func : hooks)
+            func(-1);
+    }
+
+    // Reads the configuration and loads it. A broken configuration leaves
+    // the one loaded before. Returns what failed, if anything did.
+    std::optional<std::string> reload()
+    {
+        try
+        {
+            load(config());
+        }
+        catch (const std::exception& e)
+        {
+            return e.what();
+        }
+        return {};
+    }
+
+    // The running instance of the app, if any.
+    child_t* child(app_id id)
+    {
+        return id < procs.size() && procs[id] ? &*procs[id] : nullptr;
+    }
+
+    // Returns false if the app is running already.
+    template<typename ... Args>
+    bool spawn(app_id id, Args&& ... args)
+    {
+        if (child(id))
+            return false;
+
+        auto proc = proc_t{ std::forward<Args>(args)... };
+
+        // watched before the slot is taken, a child without a watch would
+        // never be reaped; if that fails, proc_t kills and reaps it
+        auto watch = watch_exit(id, proc.pidfd.fd);
+
+        apps.pid[id] = proc.pid;
+        procs[id].emplace(child_t{ std::move(proc), watch });
+
+        auto& app = apps.apps[id];
+        app.started = std::time(nullptr);
+        ++app.starts;
+        publish(id);
+        emit(id, "started", "pid %d", int(apps.pid[id]));
+
+        auto [first, last] = on_start.equal_range(apps.name(id));
+        auto hooks = std::vector<std::function<void(pid_t)>>{};
+        for (auto hook = first; hook != last; ++hook)
+            hooks.push_back(std::move(hook->second));
+        on_start.erase(first, last);
+
+        for (auto& func : hooks)
+            func(apps.pid[id]);
+
+        return true;
+    }
+
+    // The exit is delivered straight to its owner, no need to scan
+    // the other children.
+    loop_t::id_t watch_exit(app_id id, int pidfd)
+    {
+        return loop.add(pidfd, EPOLLIN, exit_handler(id));
+    }
+
+    loop_t::handler_t exit_handler(app_id id)
+    {
+        return [this, id](uint32_t) { reap(id); };
+    }
+
+    void reap(app_id id)
+    {
+        auto child = std::move(*procs[id]);
+        procs[id].reset();
+
+        loop.del(child.watch);
+        apps.pid[id] = -1;
+        struct rusage usage;
+        auto ex = child.proc.wait(&usage);
+        resume();
+        apps.exit[id] = ex;
+        apps.apps[id].usage = usage;
+        publish(id);
+
+        if (const auto* e = std::get_if<e_exit>(&ex))
+            emit(id, "exited", "exit %d", e->ret);
+        else if (const auto* s = std::get_if<e_sig>(&ex))
+            emit(id, "exited", "signal %d", s->sig);
+
+        for (auto& func : child.on_exit)
+            func(ex);
+    }
+
+    // Records a change of the app's state, and writes it to the status
+    // page, where its record is at its id.
+    void publish(app_id id)
+    {
+        auto& app = apps.apps[id];
+        app.gen = ++generation;
+
+        if (!status.map)
+            return;
+
+        const auto& ex = apps.exit[id];
+        auto name = apps.name(id);
+
+        status.begin();
+        auto& rec = status.at(id);
+
+        std::memset(rec.name, 0, sizeof(rec.name));
+        std::memcpy(rec.name, name.data(),
+                    std::min(name.size(), sizeof(rec.name)));
+        rec.pid = apps.pid[id];
+        rec.state = apps.running(id) ? status_record_t::running
+                                     : status_record_t::stopped;
+        rec.exit_kind = status_record_t::none;
+        rec.exit_value = 0;
+        if (const auto* e = ex ? std::get_if<e_exit>(&*ex) : nullptr)
+        {
+            rec.exit_kind = status_record_t::exited;
+            rec.exit_value = e->ret;
+        }
+        else if (const auto* s = ex ? std::get_if<e_sig>(&*ex) : nullptr)
+        {
+            rec.exit_kind = status_record_t::signaled;
+            rec.exit_value = s->sig;
+        }
+        rec.started = app.started;
+        rec.restarts = app.starts > 0 ? app.starts - 1 : 0;
+
+        status.end();
+    }
+
+    // Streams an event about an app to its watchers, as a single line
+    // ‹KIND APP DETAIL›. A watcher which does not keep up loses events,
+    // it is told how many before the next one it gets.
+    template<typename ... Args>
+    void emit(app_id id, const char* kind, const char* fmt, Args&& ... args)
+    {
+        if (watchers.empty())
+            return;
+
+        auto detail = message{};
+        detail.add_line(fmt, std::forward<Args>(args)...);
+
+        auto name = apps.name(id);
+        auto event = message{ "event", "%s %.*s %s", kind, int(name.size()),
+                              name.data(), detail.line(0) };
+
+        // a watcher may be dropped along with its connection meanwhile
+        auto keys = std::vector<decltype(watchers)::key_type>{};
+        for (const auto& [key, w] : watchers)
+            if (!w.apps || w.apps->count(id) != 0)
+                keys.push_back(key);
+
+        for (const auto& key : keys)
+        {
+            auto w = watchers.find(key);
+            auto c = conns.find(key.first);
+            if (w == watchers.end() || c == conns.end())
+                continue;
+
+            auto& watcher = w->second;
+            if (c->second.tx.size() - c->second.sent >= watcher_t::Backlog)
+            {
+                ++watcher.dropped;
+                continue;
+            }
+
+            if (watcher.dropped != 0)
+            {
+                auto lost = message{ "event", "dropped %llu",
+                                     (unsigned long long) watcher.dropped };
+                watcher.dropped = 0;
+                send(watcher.to, lost);
+            }
+            send(watcher.to, event);
+        }
+    }
+
+    void listen(fd_t listening)
+    {
+        sock = std::move(listening);
+        sock_watch = loop.add(sock.fd, EPOLLIN, [this](uint32_t)
+        {
+            accept();
+        });
+
+        // a log closed frees fds for the clients, as any other fd
+        logs.on_close = [this]() { resume(); };
+    }
+
+    void accept()
+    {
+        // accept every pending connection, not just one per wakeup,
+        // up to the limit, the rest waits in the backlog
+        while (conns.size() < max_clients)
+        {
+            fd_t client = ::accept4(sock.fd, nullptr, nullptr,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (!client)
+            {
+                int err = errno;
+                if (err == EAGAIN || err == EWOULDBLOCK)
+                    return;
+
+                log_errno(err);
+                if (err == EINTR || err == ECONNABORTED)
+                    continue;
+
+                // the connection stays ready, it would be reported again
+                // and again until an fd is closed
+                if (err == EMFILE || err == ENFILE)
+                    break;
+                return;  // do not exit in case a client connection fails
+            }
+
+            attach(std::move(client));
+        }
+
+        paused = true;
+        loop.mod(sock_watch, 0);
+    }
+
+    // Accepts connections again, if they were paused and there may be room
+    // for them now.
+    void resume()
+    {
+        if (!paused || conns.size() >= max_clients)
+            return;
+
+        paused = false;
+        loop.mod(sock_watch, EPOLLIN);
+    }
+
+    conn_id attach(fd_t client)
+    {
+        // watched before it is kept, a client is closed if that fails
+        conn_id id = next_conn++;
+        auto watch = loop.add(client.fd, EPOLLIN, [this, id](uint32_t ev)
+        {
+            on_event(id, ev);
+        });
+
+        conns.emplace(id, conn_t{ std::move(client), watch });
+        return id;
+    }
+
+    void on_event(conn_id id, uint32_t ev)
+    {
+        if (ev & (EPOLLERR | EPOLLHUP))
+            return drop(id);
+
+        if (ev & EPOLLIN)
+            receive(id);
+
+        if (ev & EPOLLOUT)
+            flush(id);
+    }
+
+    void receive(conn_id id)
+    {
+        auto it = conns.find(id);
+        if (it == conns.end())
+            return;
+        auto& conn = it->second;
+
+        char buf[16384];
+        while (true)
+        {
+            auto r = conn.sock.read(buf, sizeof(buf));
+            if (r > 0)
+            {
+                conn.rx.append(buf, r);
+                if (conn.rx.size() >= sizeof(buf))
+                    break;  // let other sources run, the rest stays ready
+                continue;
+            }
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (r == -1)
+                return drop(id);
+
+            conn.eof = true;
+            break;
+        }
+
+        size_t pos = 0;
+        while (pos < conn.rx.size())
+        {
+            message msg;
+            size_t used = 0;
+            try
+            {
+                used = msg.parse(conn.rx.data() + pos, conn.rx.size() - pos);
+            }
+            catch (const std::exception& e)
+            {
+                const char* data = conn.rx.data() + pos;
+                size_t len = conn.rx.size() - pos;
+
+                // an old client must get to write its whole request first,
+                // otherwise it fails on a broken pipe instead of our reply
+                if (!conn.eof && message::legacy(data, len)
+                        && len < message::legacy_size(data))
+                    break;
+
+                log_err(e.what());
+                return reject(conn, e.what());
+            }
+
+            if (used == 0)
+                break;
+            pos += used;
+
+            // ‹conn› may be gone once the command returns
+            if (!dispatch(id, conn, msg))
+                return;
+        }
+
+        it = conns.find(id);
+        if (it == conns.end())
+            return;
+
+        // an incomplete request cannot be completed after the end
+        it->second.rx.erase(0, it->second.eof ? std::string::npos : pos);
+        if (it->second.done())
+            return drop(id);
+        update(it->second);
+    }
+
+    // Returns whether the connection still exists.
+    bool dispatch(conn_id id, conn_t& conn, const message& msg)
+    {
+        auto to = reply_t{ id, msg.id };
+
+        if (!conn.pending.try_emplace(msg.id).second)
+        {
+            auto resp = message{ "error", "request %u is already in flight",
+                                 unsigned(msg.id) };
+            queue(to, resp);
+            return conns.count(id) != 0;
+        }
+
+        handle(*this, to, msg);
+        return conns.count(id) != 0;
+    }
+
+    // Answers an unparsable request in the client's own format, if it is
+    // recognizable, and closes the connection once that is written.
+    void reject(conn_t& conn, const char* what)
+    {
+        bool legacy = message::legacy(conn.rx.data(), conn.rx.size());
+
+        conn.rx.clear();
+        conn.eof = true;
+
+        auto resp = message{ "error", what };
+        if (legacy)
+            conn.tx += message::legacy_error("srvctl is older than srvd, "
+                                             "please upgrade it");
+        else
+            resp.serialize(conn.tx);
+
+        update(conn);
+    }
+
+    void flush(conn_id id)
+    {
+        auto it = conns.find(id);
+        if (it == conns.end())
+            return;
+        auto& conn = it->second;
+
+        while (conn.sent < conn.tx.size())
+        {
+            auto w = conn.sock.write(conn.tx.data() + conn.sent,
+                                     conn.tx.size() - conn.sent);
+            if (w == -1 && errno == EINTR)
+                continue;
+            if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (w == -1)
+                return drop(id);
+            conn.sent += w;
+        }
+
+        if (conn.sent == conn.tx.size())
+        {
+            conn.tx.clear();
+            conn.sent = 0;
+
+            // the hooks may queue more, and even drop the connection
+            if (!conn.on_drain.empty())
+            {
+                auto hooks = std::move(conn.on_drain);
+                conn.on_drain.clear();
+                for (auto& func : hooks)
+                    func();
+                return flush(id);
+            }
+        }
+
+        if (conn.done())
+            return drop(id);
+
+        update(conn);
+    }
+
+    void update(conn_t& conn)
+    {
+        loop.mod(conn.watch, conn.interest());
+    }
+
+    // Bytes queued to the client and not yet written.
+    size_t backlog(conn_id id) const
+    {
+        auto it = conns.find(id);
+        return it == conns.end() ? 0 : it->second.tx.size() - it->second.sent;
+    }
+
+    // Called once the client has taken everything queued so far, so that
+    // long replies can be produced at the pace the client reads them.
+    void on_drain(conn_id id, std::function<void()> func)
+    {
+        auto it = conns.find(id);
+        if (it == conns.end())
+            return;
+
+        if (it->second.sent == it->second.tx.size())
+            return func();
+        it->second.on_drain.push_back(std::move(func));
+    }
+
+    // Whether the request is yet to be answered, by a client still there.
+    bool waiting(const reply_t& to) const
+    {
+        auto it = conns.find(to.conn);
+        return it != conns.end() && it->second.pending.count(to.id) != 0;
+    }
+
+    // Called when the connection is gone before the final reply.
+    void on_close(const reply_t& to, std::function<void()> func)
+    {
+        auto it = conns.find(to.conn);
+        if (it == conns.end())
+            return;
+
+        auto req = it->second.pending.find(to.id);
+        if (req != it->second.pending.end())
+            req->second.push_back(std::move(func));
+    }
+
+    // Queues a partial reply, more replies are to follow.
+    void send(const reply_t& to, message msg)
+    {
+        msg.more = true;
+        queue(to, msg);
+    }
+
+    // Queues the final reply to a request.
+    void finish(const reply_t& to, message msg)
+    {
+        auto it = conns.find(to.conn);
+        if (it == conns.end())
+            return;
+
+        it->second.pending.erase(to.id);
+
+        msg.more = false;
+        queue(to, msg);
+    }
+
+    void queue(const reply_t& to, message& msg)
+    {
+        auto it = conns.find(to.conn);
+        if (it == conns.end())
+            return;
+        auto& conn = it->second;
+
+        msg.id = to.id;
+
+        // nothing is waiting, so the message may go out directly,
+        // without being copied to the buffer
+        if (conn.tx.empty())
+        {
+            ssize_t w = msg.write(conn.sock);
+            if (w == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+                return drop(to.conn);
+
+            size_t done = std::max<ssize_t>(w, 0);
+            if (done < msg.wire_size())
+                msg.serialize(conn.tx, done);
+        }
+        else
+        {
+            msg.serialize(conn.tx);
+        }
+
+        flush(to.conn);
+    }
+
+    void drop(conn_id id)
+    {
+        auto it = conns.find(id);
+        if (it == conns.end())
+            return;
+
+        auto conn = std::move(it->second);
+        conns.erase(it);
+
+        loop.del(conn.watch);
+        for (auto& [req, funcs] : conn.pending)
+            for (auto& func : funcs)
+                func();
+
+        // a slot is free again, and an fd
+        resume();
+    }
+};
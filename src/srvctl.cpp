@@ -3,33 +3,198 @@
 #include "commands.hpp" // COMMANDS, print_help
 #include "message.hpp"  // message
 #include "common.hpp"   // *_PATH
-#include "fd.hpp"       // fd_t
+#include "client.hpp"   // client_t
+#include "status.hpp"   // status_reader_t
 
 // posix
-#include <unistd.h>     // write, read, close
-#include <sys/socket.h> // bind, socket, connect, listen, accept
-#include <sys/types.h>  // bind, socket, connect, listen, accept
-#include <sys/un.h>     // sockaddr_un
+#include <signal.h>     // kill
+#include <string.h>     // strnlen
 
 // c
-#include <cstdio>       // printf, perror
-#include <cstring>      // strncpy, strerror
+#include <cstdio>       // printf
 #include <cerrno>       // errno
 
 // cpp
+#include <algorithm>    // find
 #include <fstream>      // ifstream
 #include <iostream>     // cout
 #include <map>          // map
+#include <optional>     // optional
 #include <filesystem>   // fs::*
+#include <sstream>      // istringstream
+#include <string>       // string
+#include <vector>       // vector
 #include <string_view>  // ""sv
 
 
 namespace fs = std::filesystem;
 
 
-void log_err(const char* str, int err)
+std::optional<client_t> connect_daemon()
 {
-    std::fprintf(stderr, "ERROR: %s: %s\n", str, std::strerror(err));
+    try
+    {
+        return client_t{ SOCK_PATH };
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "ERROR: %s\n", e.what());
+        std::fprintf(stderr,
+                     "\nPerhaps the daemon is not running,\n"
+                     "try starting it with ‹srvd› first\n");
+        return {};
+    }
+}
+
+
+struct batch_cmd
+{
+    std::string text;
+    message msg;
+};
+
+
+// Reads one command per line, empty lines and lines starting with ‹#›
+// are skipped. A command which is not valid is reported as failed, in the
+// form of a result, the others are read on. Returns false if there is one.
+bool read_batch(std::istream& in, std::vector<batch_cmd>& cmds)
+{
+    bool ok = true;
+
+    auto line = std::string{};
+    for (size_t nr = 1; std::getline(in, line); ++nr)
+    {
+        auto words = std::istringstream{ line };
+        auto word = std::string{};
+
+        if (!(words >> word) || word[0] == '#')
+            continue;
+
+        if (COMMANDS.count(word) == 0)
+        {
+            std::cout << "[error] " << line << '\n'
+                      << "    line " << nr << ": invalid command '" << word
+                      << "'\n";
+            ok = false;
+            continue;
+        }
+
+        auto msg = message{ word.c_str() };
+        while (words >> word)
+            msg.add_line(word.c_str());
+
+        msg.id = cmds.size();
+        cmds.push_back(batch_cmd{ line, std::move(msg) });
+    }
+
+    return ok;
+}
+
+
+// Sends all commands down a single connection, and prints the results in
+// the order they arrive.
+int run_batch(std::istream& in)
+{
+    auto cmds = std::vector<batch_cmd>{};
+    bool failed = !read_batch(in, cmds);
+
+    if (cmds.empty())
+        return failed ? 1 : 0;
+
+    auto client = connect_daemon();
+    if (!client)
+        return 1;
+
+    for (auto& cmd : cmds)
+    {
+        const auto& text = cmd.text;
+        client->submit(std::move(cmd.msg), [&](const message& resp)
+        {
+            if (resp.more)
+            {
+                for (size_t i = 0; i < resp.size(); ++i)
+                    std::cout << text << ": " << resp.line(i) << '\n';
+                return;
+            }
+
+            std::cout << "[" << resp.arg << "] " << text << '\n';
+            for (size_t i = 0; i < resp.size(); ++i)
+                std::cout << "    " << resp.line(i) << '\n';
+
+            failed |= resp.arg != "ok";
+        });
+    }
+
+    while (client->in_flight() > 0)
+    {
+        client->wait();
+        std::cout.flush();
+    }
+
+    return failed ? 1 : 0;
+}
+
+
+int run_batch(int argc, char** argv, int first)
+{
+    using namespace std::literals;
+
+    if (argc == first)
+        return run_batch(std::cin);
+
+    if (argc == first + 2 && argv[first] == "-f"sv)
+    {
+        auto file = std::ifstream{ argv[first + 1] };
+        if (!file)
+            return std::fprintf(stderr, "ERROR: cannot open '%s'\n",
+                                argv[first + 1]), 1;
+        return run_batch(file);
+    }
+
+    std::fprintf(stderr, "Usage: %s batch [-f FILE]\n", argv[0]);
+    return 1;
+}
+
+
+// Prints the table of ‹list› from the status page, without a round trip
+// to the daemon. Returns false if the page cannot be read.
+bool list_local()
+{
+    auto reader = status_reader_t{};
+    auto snap = std::optional<status_snapshot_t>{};
+
+    // the page may be replaced while it is being read
+    for (int tries = 0; tries < 3 && !snap; ++tries)
+        if (reader.open(STAT_PATH))
+            snap = reader.read();
+
+    if (!snap)
+        return false;
+
+    if (!snap->live || (::kill(snap->daemon, 0) == -1 && errno == ESRCH))
+        std::fprintf(stderr, "WARNING: srvd is not running, this is the last "
+                             "state it published\n\n");
+
+    auto resp = message{ "ok" };
+    list_header(resp);
+    for (const auto& rec : snap->records)
+    {
+        auto ex = std::optional<exit_t>{};
+        if (rec.exit_kind == status_record_t::exited)
+            ex = e_exit{ rec.exit_value };
+        if (rec.exit_kind == status_record_t::signaled)
+            ex = e_sig{ rec.exit_value };
+
+        auto name = std::string(rec.name, ::strnlen(rec.name, sizeof(rec.name)));
+        list_row(resp, name.c_str(),
+                 rec.state == status_record_t::running ? rec.pid : -1,
+                 ex);
+    }
+
+    std::cout << "[" << resp.arg << "]\n";
+    for (size_t i = 0; i < resp.size(); ++i)
+        std::cout << resp.line(i) << '\n';
+    return true;
 }
 
 
@@ -45,6 +210,12 @@ int run(int argc, char** argv)
     if (argv[1] == "--help"sv || argv[1] == "help"sv)
         return print_help(argv[0]), 0;
 
+    if (argv[1] == "batch"sv)
+        return run_batch(argc, argv, 2);
+
+    if (argv[1] == "-f"sv)
+        return run_batch(argc, argv, 1);
+
     if (COMMANDS.count(argv[1]) == 0)
     {
         std::fprintf(stderr, "Invalid command.\nUsage: %s CMD [ARG]\n"
@@ -53,39 +224,34 @@ int run(int argc, char** argv)
         return 1;
     }
 
+    if (argc == 2 && argv[1] == "list"sv && list_local())
+        return 0;
+
     auto msg = message{ argv[1] };
 
     for (int i = 2; i < argc; i++)
         msg.add_line(argv[i]);
 
-    fd_t sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (!sock)
-        return log_err("socket", errno), 1;
-
-    struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    std::strncpy(addr.sun_path, SOCK_PATH.c_str(), sizeof(addr.sun_path));
-
-    if (connect(sock.fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
-    {
-        log_err("connect", errno);
-        std::fprintf(stderr,
-                     "\nPerhaps the daemon is not running,\n"
-                     "try starting it with ‹srvd› first\n");
+    auto client = connect_daemon();
+    if (!client)
         return 1;
-    }
-
-    if (auto err = msg.send(sock))
-        return log_err("send", *err), 1;
 
-    if (auto err = msg.recv(sock))
-        return log_err("recv", *err), 1;
+    // partial replies, such as the output of an update, come first
+    msg = client->call(std::move(msg), [](const message& part)
+    {
+        for (size_t i = 0; i < part.size(); ++i)
+            std::cout << part.line(i) << '\n';
+        std::cout.flush();
+    });
 
-    std::cout << "[" << msg.arg << "]\n";
-    for (const auto& line : msg.contents)
-        std::cout << line.data() << std::endl;
+    // output meant for programs is left as it is, errors go to stderr
+    bool raw = std::find(argv + 2, argv + argc, "--json"sv) != argv + argc;
+    auto& out = raw && msg.arg != "ok"sv ? std::cerr : std::cout;
 
-    using namespace std::literals;
+    if (!raw || msg.arg != "ok"sv)
+        out << "[" << msg.arg << "]\n";
+    for (size_t i = 0; i < msg.size(); ++i)
+        out << msg.line(i) << '\n';
 
     if (msg.arg == "error"sv)
         return 1;
@@ -0,0 +1,284 @@
+#pragma once
+
+// headers
+#include "fd.hpp"       // fd_t
+
+// posix
+#include <sys/mman.h>   // mmap, munmap
+#include <sys/stat.h>   // fstat
+#include <sys/types.h>  // ftruncate
+#include <fcntl.h>      // open
+#include <unistd.h>     // ftruncate, getpid
+
+// c
+#include <cstdint>      // int*_t, uint*_t
+#include <cstring>      // memcpy, strncpy, memset
+#include <ctime>        // time
+
+// cpp
+#include <algorithm>    // min
+#include <atomic>       // atomic, atomic_thread_fence
+#include <filesystem>   // fs::*
+#include <new>          // placement new
+#include <optional>     // optional
+#include <stdexcept>    // runtime_error
+#include <string>       // string
+#include <utility>      // exchange
+#include <vector>       // vector
+
+
+/*
+ * Status page, a memory-mapped table of apps published by srvd in
+ * ~/.srvctl/.status, so that their state can be read without asking the
+ * daemon. The daemon is the only writer, readers map the file read-only.
+ *
+ * Consistency is guarded by a sequence lock: the writer makes ‹seq› odd
+ * before changing anything and even again afterwards, a reader retries
+ * if it saw an odd ‹seq›, or if ‹seq› changed while it was copying.
+ *
+ * When the table has to grow, a new file replaces the old one, which gets
+ * ‹moved› set, so that readers know to map the file again. The file stays
+ * after the daemon exits, with ‹live› cleared, as the last known state.
+ */
+struct status_record_t
+{
+    static constexpr size_t NameSize = 64;
+
+    enum state_t : std::uint8_t { stopped = 0, running = 1 };
+    enum exit_kind_t : std::uint8_t { none = 0, exited = 1, signaled = 2 };
+
+    char name[NameSize];
+    std::int32_t pid;           // -1 unless running
+    std::uint8_t state;         // state_t
+    std::uint8_t exit_kind;     // exit_kind_t, of the last run
+    std::int32_t exit_value;    // return value or signal
+    std::int64_t started;       // unix time of the last start, 0 if never
+    std::uint32_t restarts;     // starts after the first one
+};
+
+
+struct status_header_t
+{
+    static constexpr char Magic[8] = "srvstat";
+    static constexpr std::uint32_t Version = 1;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t capacity;
+    std::atomic<std::uint64_t> seq;
+    std::uint32_t count;
+    std::int32_t daemon;        // pid
+    std::uint8_t live;          // cleared when the daemon exits
+    std::uint8_t moved;         // replaced by a new file
+};
+
+
+struct status_map_t
+{
+    void* addr = MAP_FAILED;
+    size_t size = 0;
+
+    status_map_t() = default;
+    status_map_t(void* a, size_t s) : addr(a), size(s) { }
+
+    status_map_t(const status_map_t&) = delete;
+    status_map_t& operator=(const status_map_t&) = delete;
+
+    status_map_t(status_map_t&& other) noexcept
+        : addr(std::exchange(other.addr, MAP_FAILED))
+        , size(std::exchange(other.size, 0))
+    { }
+
+    status_map_t& operator=(status_map_t&& other) noexcept
+    {
+        std::swap(addr, other.addr);
+        std::swap(size, other.size);
+        return *this;
+    }
+
+    ~status_map_t()
+    {
+        if (addr != MAP_FAILED)
+            ::munmap(addr, size);
+    }
+
+    explicit operator bool() const { return addr != MAP_FAILED; }
+
+    status_header_t* head() const { return static_cast<status_header_t*>(addr); }
+
+    status_record_t* records() const
+    {
+        return reinterpret_cast<status_record_t*>(static_cast<char*>(addr)
+                                           + sizeof(status_header_t));
+    }
+};
+
+
+inline size_t status_size(size_t capacity)
+{
+    return sizeof(status_header_t) + capacity * sizeof(status_record_t);
+}
+
+
+// The daemon's side.
+struct status_writer_t
+{
+    std::filesystem::path path;
+    status_map_t map{};
+
+    status_writer_t() = default;
+
+    status_writer_t(const status_writer_t&) = delete;
+    status_writer_t& operator=(const status_writer_t&) = delete;
+
+    ~status_writer_t()
+    {
+        if (!map)
+            return;
+
+        begin();
+        map.head()->live = 0;
+        end();
+    }
+
+    // Publishes a new, empty table of ‹capacity› records.
+    void create(const std::filesystem::path& file, size_t capacity)
+    {
+        path = file;
+        auto tmp = std::filesystem::path{ file } += ".tmp";
+
+        fd_t fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         0644);
+        if (!fd)
+            throw std::runtime_error("status: open");
+
+        size_t size = status_size(capacity);
+        if (::ftruncate(fd.fd, size) == -1)
+            throw std::runtime_error("status: ftruncate");
+
+        void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd.fd, 0);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("status: mmap");
+
+        auto fresh = status_map_t{ addr, size };
+        auto* head = new (fresh.head()) status_header_t{};
+        std::memcpy(head->magic, status_header_t::Magic, sizeof(head->magic));
+        head->version = status_header_t::Version;
+        head->capacity = capacity;
+        head->seq.store(0);
+        head->count = 0;
+        head->daemon = ::getpid();
+        head->live = 1;
+        head->moved = 0;
+
+        std::filesystem::rename(tmp, file);
+
+        if (map)
+        {
+            begin();
+            map.head()->live = 0;
+            map.head()->moved = 1;
+            end();
+        }
+        map = std::move(fresh);
+    }
+
+    size_t capacity() const { return map ? map.head()->capacity : 0; }
+
+    void begin()
+    {
+        auto& seq = map.head()->seq;
+        seq.store(seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void end()
+    {
+        auto& seq = map.head()->seq;
+        seq.store(seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+    }
+
+    // To be called between begin() and end().
+    status_record_t& at(size_t slot)
+    {
+        auto* head = map.head();
+        if (slot >= head->count)
+            head->count = slot + 1;
+        return map.records()[slot];
+    }
+};
+
+
+struct status_snapshot_t
+{
+    bool live;
+    std::int32_t daemon;
+    std::vector<status_record_t> records;
+};
+
+
+// The side of srvctl and other monitors. Only the initial open and mmap
+// are system calls, reading a snapshot is not.
+struct status_reader_t
+{
+    status_map_t map{};
+
+    bool open(const std::filesystem::path& file)
+    {
+        fd_t fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd)
+            return false;
+
+        struct stat st;
+        if (::fstat(fd.fd, &st) == -1
+                || size_t(st.st_size) < sizeof(status_header_t))
+            return false;
+
+        void* addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED,
+                            fd.fd, 0);
+        if (addr == MAP_FAILED)
+            return false;
+
+        map = status_map_t{ addr, size_t(st.st_size) };
+
+        auto* head = map.head();
+        return std::memcmp(head->magic, status_header_t::Magic,
+                           sizeof(head->magic)) == 0
+            && head->version == status_header_t::Version
+            && status_size(head->capacity) <= map.size;
+    }
+
+    // Returns nothing if the file was replaced in the meantime, or if no
+    // consistent snapshot could be taken.
+    std::optional<status_snapshot_t> read() const
+    {
+        auto* head = map.head();
+        auto res = status_snapshot_t{};
+
+        // bounded, the daemon might have died in the middle of a write
+        for (int tries = 0; tries < (1 << 20); ++tries)
+        {
+            auto seq = head->seq.load(std::memory_order_acquire);
+            if (seq % 2 == 1)
+                continue;
+
+            if (head->moved)
+                return {};
+
+            size_t count = std::min(head->count, head->capacity);
+            res.live = head->live;
+            res.daemon = head->daemon;
+            res.records.resize(count);
+            std::memcpy(res.records.data(), map.records(),
+                        count * sizeof(status_record_t));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (head->seq.load(std::memory_order_relaxed) == seq)
+                return res;
+        }
+        return {};
+    }
+};
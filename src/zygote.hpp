@@ -0,0 +1,367 @@
+#pragma once
+
+// headers
+#include "proc.hpp"     // spawn_t, clone_exec, spawn
+#include "log.hpp"      // *log*
+#include "fd.hpp"       // fd_t
+
+// posix
+#include <sys/socket.h> // socketpair, sendmsg, recvmsg, SCM_RIGHTS
+#include <sys/prctl.h>  // prctl
+#include <sys/wait.h>   // waitpid
+#include <sched.h>      // clone, CLONE_*
+#include <signal.h>     // kill, sigprocmask, SIG*
+#include <unistd.h>     // fork, close, _exit
+
+// c
+#include <cerrno>       // errno
+#include <cstdint>      // int32_t
+#include <cstring>      // memcpy, strerror, strnlen
+
+// cpp
+#include <algorithm>    // max
+#include <stdexcept>    // runtime_error
+#include <string>       // string
+#include <utility>      // exchange
+#include <vector>       // vector
+
+
+/*
+ * The spawn helper: a process forked by ‹srvd --spawn-helper› at boot,
+ * before anything is loaded, which spawns the apps on its behalf from its
+ * own small image. The apps get none of the daemon's descriptors, only
+ * those attached to the request.
+ *
+ * Each request is a datagram over a socketpair, with the setup of the child
+ * and the fds it is to get, and that of its executable, by SCM_RIGHTS. The
+ * child is cloned with CLONE_PARENT, so it is a child of srvd, which waits
+ * for it as for any other, and its pidfd is sent back the same way. That
+ * is why the helper clones whichever engine srvd is built with, neither a
+ * fork nor posix_spawn could make the child srvd's.
+ */
+struct zygote_t
+{
+    static constexpr size_t MaxRequest = 64 << 10;
+    static constexpr size_t MaxFds = 8;
+
+    // the helper is gone, spawning in the daemon is left
+    struct lost_error : std::runtime_error
+    {
+        using std::runtime_error::runtime_error;
+    };
+
+    fd_t sock{ -1 };
+    pid_t pid = -1;
+
+    zygote_t() = default;
+
+    zygote_t(const zygote_t&) = delete;
+    zygote_t& operator=(const zygote_t&) = delete;
+
+    zygote_t(zygote_t&& other) noexcept
+        : sock(std::move(other.sock))
+        , pid(std::exchange(other.pid, -1))
+    { }
+
+    // the helper exits once its end of the socket is closed
+    ~zygote_t()
+    {
+        sock.close();
+        if (pid != -1)
+            ::waitpid(pid, nullptr, 0);
+    }
+
+    static zygote_t start()
+    {
+        int pair[2];
+        if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair)
+                == -1)
+            throw std::runtime_error("socketpair");
+
+        auto res = zygote_t{};
+        res.pid = ::fork();
+        if (res.pid == -1)
+        {
+            ::close(pair[0]);
+            ::close(pair[1]);
+            throw std::runtime_error("fork");
+        }
+
+        if (res.pid == 0)
+        {
+            ::close(pair[0]);
+            ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+            ::prctl(PR_SET_NAME, "srvd-spawn");
+            serve(pair[1]);
+            ::_exit(0);
+        }
+
+        ::close(pair[1]);
+        res.sock = pair[0];
+        return res;
+    }
+
+    // Like the spawn engines, throws lost_error if the helper is gone.
+    pid_t spawn(spawn_t& s, int& pidfd)
+    {
+        auto req = std::string{};
+        auto fds = std::vector<int>{};
+
+        std::int32_t argc = 0;
+        while (s.argv[argc])
+            ++argc;
+
+        put(req, argc);
+        put(req, std::int32_t(s.dups.size()));
+        for (size_t i = 0; s.argv[i]; ++i)
+            put(req, s.argv[i]);
+        put(req, s.cwd);
+        for (auto [target, fd] : s.dups)
+            put(req, std::int32_t(target)), fds.push_back(fd);
+
+        // the executable found by srvd, its descriptor after those of dups
+        put(req, std::int32_t(s.exe.fd != -1));
+        put(req, s.exe.path ? s.exe.path : "");
+        if (s.exe.fd != -1)
+            fds.push_back(s.exe.fd);
+        put(req, std::int32_t(s.group));
+
+        if (req.size() > MaxRequest || fds.size() > MaxFds)
+            throw std::runtime_error("spawn: request too large");
+
+        // an fd to pass which is not open is the request's fault
+        if (send(sock.fd, req, fds) == -1)
+        {
+            if (errno == EBADF)
+                throw std::runtime_error("spawn: fd not open");
+            throw lost_error(std::string{ "spawn helper: " }
+                             + std::strerror(errno));
+        }
+
+        auto resp = std::string{};
+        fds.clear();
+        if (recv(sock.fd, resp, fds, 64) <= 0 || resp.size() != 3 * 4)
+            throw lost_error("spawn helper: no reply");
+
+        size_t pos = 0;
+        std::int32_t pid = 0, err = 0, exec_err = 0;
+        get(resp, pos, pid);
+        get(resp, pos, err);
+        get(resp, pos, exec_err);
+
+        if (pid > 0 && fds.size() == 1)
+        {
+            if (exec_err != 0)
+                log_err("exec '", s.argv[0], "': ", std::strerror(exec_err));
+            pidfd = fds[0];
+            return pid;
+        }
+
+        for (int fd : fds)
+            ::close(fd);
+
+        // a child without its pidfd would never be reaped through the loop,
+        // it is still ours to kill and wait for, as the helper cloned it
+        // for srvd
+        if (pid > 0)
+        {
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+        }
+        if (pid > 0 || err == 0)
+            throw std::runtime_error("spawn helper: protocol error");
+        throw std::runtime_error(std::string{ "clone: " }
+                                 + std::strerror(err));
+    }
+
+private:
+    static void put(std::string& buf, std::int32_t val)
+    {
+        buf.append(reinterpret_cast<const char*>(&val), sizeof(val));
+    }
+
+    static void put(std::string& buf, const char* str)
+    {
+        buf.append(str);
+        buf.push_back('\0');
+    }
+
+    static bool get(const std::string& buf, size_t& pos, std::int32_t& val)
+    {
+        if (buf.size() - pos < sizeof(val))
+            return false;
+        std::memcpy(&val, buf.data() + pos, sizeof(val));
+        pos += sizeof(val);
+        return true;
+    }
+
+    // Points into ‹buf›, which must stay unchanged.
+    static bool get(const std::string& buf, size_t& pos, const char*& str)
+    {
+        size_t len = ::strnlen(buf.data() + pos, buf.size() - pos);
+        if (pos + len == buf.size())
+            return false;
+        str = buf.data() + pos;
+        pos += len + 1;
+        return true;
+    }
+
+    static ssize_t send(int sock, const std::string& data,
+                        const std::vector<int>& fds)
+    {
+        struct iovec iov = { const_cast<char*>(data.data()), data.size() };
+        alignas(struct cmsghdr) char ctl[CMSG_SPACE(sizeof(int) * MaxFds)];
+
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (!fds.empty())
+        {
+            msg.msg_control = ctl;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+            auto* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+
+        ssize_t r;
+        while ((r = ::sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1
+                && errno == EINTR)
+            ;
+        return r;
+    }
+
+    // The fds received are close-on-exec.
+    static ssize_t recv(int sock, std::string& data, std::vector<int>& fds,
+                        size_t max = MaxRequest)
+    {
+        data.resize(max);
+        struct iovec iov = { data.data(), data.size() };
+        alignas(struct cmsghdr) char ctl[CMSG_SPACE(sizeof(int) * MaxFds)];
+
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl;
+        msg.msg_controllen = sizeof(ctl);
+
+        ssize_t r;
+        while ((r = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1
+                && errno == EINTR)
+            ;
+        data.resize(std::max<ssize_t>(r, 0));
+
+        for (auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t at = fds.size();
+            fds.resize(at + count);
+            std::memcpy(fds.data() + at, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+        return r;
+    }
+
+    // The helper's loop, until srvd closes the socket.
+    [[noreturn]] static void serve(int sock)
+    {
+        auto req = std::string{};
+        auto fds = std::vector<int>{};
+        auto argv = std::vector<char*>{};
+
+        while (true)
+        {
+            fds.clear();
+            if (recv(sock, req, fds) <= 0)
+                ::_exit(0);
+
+            auto s = spawn_t{ nullptr, nullptr };
+            std::int32_t argc = 0, dups = 0, exe_fd = 0, group = 0;
+            size_t pos = 0;
+
+            bool ok = get(req, pos, argc) && get(req, pos, dups) && argc > 0
+                   && size_t(dups) <= fds.size();
+
+            argv.assign(ok ? argc + 1 : 0, nullptr);
+            for (std::int32_t i = 0; ok && i < argc; ++i)
+            {
+                const char* arg = nullptr;
+                ok = get(req, pos, arg);
+                argv[i] = const_cast<char*>(arg);
+            }
+            ok = ok && get(req, pos, s.cwd);
+
+            for (std::int32_t i = 0; ok && i < dups; ++i)
+            {
+                std::int32_t target = -1;
+                ok = get(req, pos, target);
+                s.dups.emplace_back(target, fds[i]);
+            }
+
+            const char* exe_path = nullptr;
+            ok = ok && get(req, pos, exe_fd) && get(req, pos, exe_path)
+                    && size_t(dups + (exe_fd != 0)) == fds.size()
+                    && get(req, pos, group);
+            s.group = group != 0;
+            if (ok && exe_fd != 0)
+                s.exe.fd = fds.back();
+            if (ok && *exe_path != '\0')
+                s.exe.path = exe_path;
+
+            std::int32_t pid = -1, err = EINVAL;
+            int pidfd = -1;
+            if (ok)
+            {
+                s.argv = argv.data();
+                pid = clone_exec(s, pidfd, CLONE_PARENT);
+                err = pid == -1 ? errno : 0;
+            }
+
+            auto resp = std::string{};
+            put(resp, pid);
+            put(resp, err);
+            put(resp, std::int32_t(s.err));
+
+            auto out = std::vector<int>{};
+            if (pidfd != -1)
+                out.push_back(pidfd);
+            send(sock, resp, out);
+
+            if (pidfd != -1)
+                ::close(pidfd);
+            for (int fd : fds)
+                ::close(fd);
+        }
+    }
+};
+
+
+// The helper srvd spawns through, if it runs.
+inline zygote_t* ZYGOTE = nullptr;
+
+
+// Spawns through the helper, or in the daemon if there is none, or if
+// it is gone.
+inline pid_t spawn_zygote(spawn_t& s, int& pidfd)
+{
+    if (ZYGOTE)
+    {
+        try
+        {
+            return ZYGOTE->spawn(s, pidfd);
+        }
+        catch (const zygote_t::lost_error& e)
+        {
+            log_err(e.what(), ", spawning in srvd from now on");
+            ZYGOTE = nullptr;
+        }
+    }
+    return spawn(s, pidfd);
+}
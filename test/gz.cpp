@@ -0,0 +1,101 @@
+// headers
+#include "src/gzip.hpp" // gzip_t
+
+// posix
+#include <unistd.h>     // read, write
+
+// c
+#include <cstdlib>      // atoi
+#include <cstdio>       // printf
+
+// cpp
+#include <string>       // string
+#include <string_view>  // string_view
+
+
+// Compresses stdin to stdout by gzip_t, at the level given, for gzip to
+// check what srvd writes:
+//
+//     gz LEVEL < FILE | gzip -dc | cmp - FILE
+//
+// or checks that logs are compressed no larger by level 9 than by level 1:
+//
+//     gz levels
+
+
+static bool put(const std::string& out)
+{
+    for (size_t done = 0; done < out.size(); )
+    {
+        ssize_t w = ::write(1, out.data() + done, out.size() - done);
+        if (w <= 0)
+            return false;
+        done += w;
+    }
+    return true;
+}
+
+
+static std::string compress(const std::string& in, int level)
+{
+    auto gz = gzip_t{ level };
+    auto out = std::string{};
+    gz.write(in.data(), in.size(), out);
+    gz.finish(out);
+    return out;
+}
+
+
+// Logs of numbered lines, as ‹seq› and test/lines.sh write them, where a
+// longer match further back costs more than it saves.
+static int levels()
+{
+    auto seq = std::string{};
+    auto lines = std::string{};
+    for (int i = 1; i <= 400000; ++i)
+    {
+        seq += std::to_string(i) + "\n";
+        if (i <= 100000)
+            lines += "line " + std::to_string(i) + " of the output of the "
+                     "app, to be rotated\n";
+    }
+
+    int res = 0;
+    for (const auto* in : { &seq, &lines })
+    {
+        auto fast = compress(*in, 1).size();
+        auto small = compress(*in, 9).size();
+        std::printf("%zu B: level 1 %zu B, level 9 %zu B\n", in->size(),
+                    fast, small);
+        if (small > fast)
+            res = 1;
+    }
+    return res;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+        return 2;
+
+    if (argv[1] == std::string_view{ "levels" })
+        return levels();
+
+    auto gz = gzip_t{ std::atoi(argv[1]) };
+    auto buf = std::string(64 << 10, '\0');
+    auto out = std::string{};
+
+    ssize_t r;
+    while ((r = ::read(0, buf.data(), buf.size())) > 0)
+    {
+        out.clear();
+        gz.write(buf.data(), r, out);
+        if (!put(out))
+            return 1;
+    }
+
+    out.clear();
+    gz.finish(out);
+    return r == 0 && put(out) ? 0 : 1;
+}
@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# numbered lines of output, as many as asked for, then idle for as many
+# seconds as asked for, if any
+for i in $(seq "$1"); do
+    echo "line $i of the output of the app, to be rotated"
+done
+
+[ -n "$2" ] && exec sleep "$2"
+exit 0
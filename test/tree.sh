@@ -0,0 +1,9 @@
+#!/bin/bash
+
+echo "(tree) starting"
+
+# a process the update leaves behind, unless its group is killed
+sleep 60 &
+sleep 60
+
+echo "(tree) exitting"
@@ -0,0 +1,105 @@
+// headers
+#include "src/client.hpp"   // client_t
+#include "src/message.hpp"  // message
+
+// posix
+#include <fcntl.h>      // fcntl
+#include <unistd.h>     // write
+
+// c
+#include <cstdio>       // printf
+#include <cstring>      // strcmp
+
+// cpp
+#include <string>       // string
+
+
+// Speaks the protocol by hand, to test what srvctl never sends:
+//
+//     wire legacy      a request in the fixed 256 B blocks of old clients
+//     wire pipeline    requests in flight together, one with an id in use
+//
+// Prints every final reply as ‹ID ARG LINE›, in the order it arrives, ‹-›
+// for the id of an old one.
+
+
+static std::string read_all(client_t& cl)
+{
+    auto res = std::string{};
+    char buf[4096];
+    ssize_t r;
+    while ((r = cl.sock.read(buf, sizeof(buf))) > 0)
+        res.append(buf, r);
+    return res;
+}
+
+
+static int legacy(client_t& cl)
+{
+    // no lines, the count byte is followed by the arg's block
+    auto req = std::string(1 + 255, '\0');
+    req.replace(1, 4, "list");
+    if (::write(cl.sock.fd, req.data(), req.size()) != ssize_t(req.size()))
+        return 1;
+
+    auto resp = read_all(cl);
+    if (resp.size() < 1 + 2 * 255)
+        return 1;
+    std::printf("- %s %s\n", resp.c_str() + 1, resp.c_str() + 1 + 255);
+    return 0;
+}
+
+
+static int pipeline(client_t& cl)
+{
+    auto slow = client_t::request("wait", { "tree", "running", "1" });
+    auto again = client_t::request("resolve", { "echo" });
+    auto quick = client_t::request("resolve", { "echo" });
+    slow.id = again.id = 7;
+    quick.id = 8;
+
+    auto req = std::string{};
+    slow.serialize(req);
+    again.serialize(req);
+    quick.serialize(req);
+    if (::write(cl.sock.fd, req.data(), req.size()) != ssize_t(req.size()))
+        return 1;
+
+    auto rx = std::string{};
+    for (int finals = 0; finals < 3; )
+    {
+        char buf[4096];
+        ssize_t r = cl.sock.read(buf, sizeof(buf));
+        if (r <= 0)
+            return 1;
+        rx.append(buf, r);
+
+        auto msg = message{};
+        while (size_t used = msg.parse(rx.data(), rx.size()))
+        {
+            rx.erase(0, used);
+            if (msg.more)
+                continue;
+            std::printf("%u %s %s\n", unsigned(msg.id), msg.arg.c_str(),
+                        msg.line(0));
+            ++finals;
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+        return 2;
+
+    // read here as it arrives, not by the client's own loop
+    auto cl = client_t{ client_t::default_socket() };
+    ::fcntl(cl.sock.fd, F_SETFL, 0);
+    if (std::strcmp(argv[1], "legacy") == 0)
+        return legacy(cl);
+    if (std::strcmp(argv[1], "pipeline") == 0)
+        return pipeline(cl);
+    return 2;
+}